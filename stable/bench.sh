@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+
+# Random-read scaling of cache_map: run after start.sh at 1, 8 and 32 submitters
+# Prints a table of IOPS and latencies for the commit or PR description.
+printf "%-11s %10s %14s %14s\n" submitters IOPS "mean lat(us)" "p99 clat(us)"
+for jobs in 1 8 32
+do
+fio -filename=/mnt/dmcache/2G.file -direct=1 -iodepth 1 -thread -rw=randread -ioengine=psync -bs=16k -size=300M -numjobs=$jobs -runtime=60 -time_based -group_reporting -name=randread$jobs -minimal |
+awk -F';' -v jobs=$jobs '{
+	p99 = "-"
+	for (i = 18; i <= 37; i++)
+		if ($i ~ /^99\.0+%=/) { split($i, v, "="); p99 = v[2] }
+	printf "%-11s %10s %14s %14s\n", jobs, $8, $40, p99
+}'
+dmsetup status >&2
+done
@@ -30,6 +30,7 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/blkdev.h>
 #include <linux/bio.h>
 #include <linux/slab.h>
@@ -37,6 +38,10 @@
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
 #include <linux/pagemap.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
 #include "dm.h"
 #include <linux/dm-io.h>
 #include <linux/dm-kcopyd.h>
@@ -56,6 +61,9 @@
 #define DEFAULT_CACHE_SIZE	65536
 #define DEFAULT_CACHE_ASSOC	1024
 #define DEFAULT_BLOCK_SIZE	8
+#define MAX_BLOCK_SIZE		256	/* Largest cache block, in sectors */
+#define MAX_CLASSES		4	/* Block size classes in one cache */
+#define SUB_BLOCK_SHIFT		3	/* 4KB sub-blocks, at most 32 a block */
 #define CONSECUTIVE_BLOCKS	512
 
 /* Write policy */
@@ -63,8 +71,26 @@
 #define WRITE_BACK 1
 #define DEFAULT_WRITE_POLICY WRITE_THROUGH
 
+/* Replacement policy */
+#define DEFAULT_REPLACEMENT_POLICY clock_policy
+
+/* Sequential stream detection */
+#define DEFAULT_SEQ_STREAMS	16	/* Number of streams tracked */
+#define MAX_SEQ_STREAMS		1024
+#define SEQ_MIN_RUN		4	/* Blocks in a row before a stream is sequential */
+#define SEQ_MAX_STRIDE		64	/* Largest stride detected, in blocks */
+#define DEFAULT_SKIP_SEQ_THRESH_KB 0	/* Never bypass sequential streams */
+#define DEFAULT_READAHEAD_KB	0	/* No readahead unless the policy asks */
+#define DEFAULT_CORR_KB		0	/* No correlation prefetching */
+#define MAX_CORR_KB		(64 * 1024)
+
+/* Flush of dirty blocks */
+#define WB_RUN_SECTORS		1024	/* Largest write to the source device */
+#define WB_MAX_RUNS		16	/* Most writes in flight */
+
 /* Number of pages for I/O */
-#define DMCACHE_COPY_PAGES 6000
+#define DMCACHE_COPY_PAGES 6000	/* Default ceiling */
+#define DMCACHE_MIN_PAGES  256	/* Reserve, never given back */
 
 /* States of a cache block */
 #define INVALID		0
@@ -72,11 +98,25 @@
 #define RESERVED	2	/* Allocated but data not in place yet */
 #define DIRTY		4	/* Locally modified */
 #define WRITEBACK	8	/* In the process of write back */
+#define PARTIAL		16	/* Only some sub-blocks are in the cache */
 
 #define is_state(x, y)		(x & y)
 #define set_state(x, y)		(x |= y)
 #define clear_state(x, y)	(x &= ~y)
 
+#define NO_TAG		((sector_t)~0)	/* Tag of a frame never used */
+
+/*
+ * Word-at-a-time helpers for scanning the packed per-set tag arrays.
+ * A state word covers sizeof(long) frames, a fingerprint word half as many.
+ */
+#define STATE_LANES		(sizeof(unsigned long))
+#define FPRINT_LANES		(sizeof(unsigned long) / sizeof(u16))
+#define REPEAT_U8(x)		((~0UL / 0xff) * (x))
+#define REPEAT_U16(x)		((~0UL / 0xffff) * (x))
+#define haszero_u8(x)		(((x) - REPEAT_U8(1)) & ~(x) & REPEAT_U8(0x80))
+#define haszero_u16(x)		(((x) - REPEAT_U16(1)) & ~(x) & REPEAT_U16(0x8000))
+
 /*
  * Cache context
  */
@@ -85,61 +125,217 @@ struct cache_c {
 	struct dm_dev *cache_dev;	/* Cache device */
 	struct dm_kcopyd_client *kcp_client; /* Kcopyd client for writing back data */
 
-	struct cacheblock *cache;	/* Hash table for cache blocks */
+	sector_t *tags;			/* Block number of each cache frame */
+	u16 *fprints;			/* Folded block number of each frame */
+	u8 *states;			/* State of each cache frame */
+	u16 *pf_tags;			/* Stream that prefetched each frame */
+	u32 *sub_valid;			/* Sub-blocks cached, if PARTIAL */
+	u32 *sub_dirty;			/* Sub-blocks modified, if PARTIAL */
+	struct cache_set *cache_sets;	/* Per-set locks and pending lists */
+	unsigned int *owned;		/* Frames per region slot, if not largest */
+	sector_t data_start;		/* First sector of the frames */
+	sector_t meta_sector;		/* Header of the metadata */
 	sector_t size;			/* Cache size */
 	unsigned int bits;		/* Cache size in bits */
 	unsigned int assoc;		/* Cache associativity */
 	unsigned int block_size;	/* Cache block size */
 	unsigned int block_shift;	/* Cache block size in bits */
 	unsigned int block_mask;	/* Cache block mask */
+	unsigned int sub_shift;		/* Sub-block size in bits */
 	unsigned int consecutive_shift;	/* Consecutive blocks size in bits */
-	unsigned long counter;		/* Logical timestamp of last access */
+	unsigned int region_shift;	/* Block size of the largest class in bits */
 	unsigned int write_policy;	/* Cache write policy */
-	sector_t dirty_blocks;		/* Number of dirty blocks */
-	sector_t step0;		/* Number of dirty blocks */
-
-	spinlock_t lock;		/* Lock to protect page allocation/deallocation */
-	struct page_list *pages;	/* Pages for I/O */
-	unsigned int nr_pages;		/* Number of pages */
-	unsigned int nr_free_pages;	/* Number of free pages */
+	unsigned int early_read;	/* Complete read misses before the store */
+	struct cache_policy *policy;	/* Replacement policy */
+	void *policy_ctx;		/* Replacement policy state */
+
+	spinlock_t seq_lock;		/* Lock to protect the stream table */
+	struct list_head seq_lru;	/* Streams, most recently used first */
+	struct seq_stream *seq_streams;	/* Recently seen streams */
+	unsigned int nr_seq_streams;	/* Number of streams tracked */
+	unsigned int skip_seq_thresh_kb; /* Bypass streams longer than this */
+	unsigned int readahead_kb;	/* Largest readahead window */
+
+	atomic_t pf_frames;		/* Frames holding unread prefetches */
+	atomic_t pf_target;		/* Most frames they may hold */
+	sector_t *pf_ghosts[2];		/* Prefetch and demand ghost tables */
+	unsigned int pf_ghost_bits;	/* Entries of a ghost table in bits */
+
+	spinlock_t corr_lock;		/* Lock to protect the successor table */
+	struct corr_entry *corr;	/* Successors of random reads, if enabled */
+	unsigned int corr_bits;		/* Entries of the table in bits */
+	unsigned int corr_kb;		/* Memory taken by the table */
+	sector_t corr_last;		/* Block of the last random read */
+
+	struct admit_filter *admit;	/* Admission filter, if enabled */
+
+	spinlock_t lock;		/* Lock to protect the page depot */
+	struct list_head depot;		/* Free pages for I/O shared by CPUs */
+	unsigned int nr_depot;		/* Number of pages in the depot */
+	struct page_mag __percpu *mags;	/* Free pages kept by each CPU */
+	atomic_t nr_pages;		/* Number of pages, free or in use */
+	unsigned int max_pages;		/* Most pages the pool may grow to */
+	struct shrinker shrinker;	/* Gives free pages back under pressure */
 	wait_queue_head_t destroyq;	/* Wait queue for I/O completion */
 	atomic_t nr_jobs;		/* Number of I/O jobs */
+	atomic_t nr_flushing;		/* Flush writes in flight */
+	wait_queue_head_t flushq;	/* Wait queue for them */
 	struct dm_io_client *io_client;   /* Client memory pool*/
 
-	/* Stats */
+	struct list_head requeue_list;	/* On _requeue_caches if bios wait */
+	struct bio_list requeue;	/* Bios to map again */
+	struct work_struct requeue_work; /* Maps them on the kcached queue */
+
+	struct cache_stats __percpu *stats; /* Per-CPU stats */
+
+	struct cache_c *top;		/* First class of the cache, or itself */
+	struct cache_c *classes[MAX_CLASSES]; /* Classes, smallest block first */
+	unsigned int nr_classes;	/* Number of them, in the first class */
+};
+
+/*
+ * Stats are kept per CPU so that the map path of different CPUs never writes
+ * to a shared line; they are summed when reported.
+ */
+struct cache_stats {
 	unsigned long reads;		/* Number of reads */
 	unsigned long writes;		/* Number of writes */
 	unsigned long cache_hits;	/* Number of cache hits */
 	unsigned long replace;		/* Number of cache replacements */
 	unsigned long writeback;	/* Number of replaced dirty blocks */
 	unsigned long dirty;		/* Number of submitted dirty blocks */
+	unsigned long prefetch;		/* Number of prefetched blocks */
+	unsigned long prefetch_hits;	/* Prefetched blocks read before eviction */
+	unsigned long prefetch_unused;	/* Prefetched blocks evicted unread */
+	unsigned long stride_hits;	/* Of prefetch_hits, from strided streams */
+	unsigned long corr_hits;	/* Of prefetch_hits, from correlations */
+	unsigned long page_stalls;	/* Jobs that waited for pages */
+	unsigned long partial_writes;	/* Write misses cached without a fetch */
+	unsigned long fills;		/* Partial frames filled from the source */
+	unsigned long coalesced;	/* Read misses fetched along with others */
+	unsigned long rejected;		/* Number of read misses not admitted */
+	unsigned long uncached_seq_reads; /* Sequential read misses bypassed */
+	unsigned long uncached_seq_writes; /* Sequential write misses bypassed */
+	long dirty_blocks;		/* Change in the number of dirty blocks */
+};
+
+#define cache_stat_inc(dmc, field)	this_cpu_inc((dmc)->stats->field)
+#define cache_stat_add(dmc, field, n)	this_cpu_add((dmc)->stats->field, n)
+
+/*
+ * A recently seen stream of bios with a constant stride: one block for a
+ * sequential stream, minus one block for a backward scan, or any other
+ * distance up to SEQ_MAX_STRIDE blocks either way. A bio for the block one
+ * stride after a stream's last block extends the stream. A bio near the last
+ * block of a stream that has not yet confirmed its stride retrains the stride;
+ * any other bio takes over the least recently used stream.
+ * The stream's readahead window starts at ra_start and covers ra_size strides
+ * onward. Its first block is the async marker: reading it issues the next
+ * window. Its prefetched blocks are tagged with the stream, so that the
+ * stream learns how many of them are read before they are evicted.
+ */
+struct seq_stream {
+	struct list_head lru;
+	sector_t last;			/* Last block of the stream */
+	long stride;			/* Blocks between bios, 0 if unknown */
+	unsigned long count;		/* Blocks at that stride so far */
+	sector_t ra_start;		/* First block of the readahead window */
+	unsigned int ra_size;		/* Blocks in the window, 0 if none */
+	unsigned int gen;		/* Times the slot was taken over */
+	unsigned int pf_used;		/* Prefetched blocks read */
+	unsigned int pf_wasted;		/* Prefetched blocks evicted unread */
 };
 
-/* Cache block metadata structure */
-struct cacheblock {
-	spinlock_t lock;	/* Lock to protect operations on the bio list */
-	sector_t block;		/* Sector number of the cached block */
-	unsigned short state;	/* State of a block */
-	unsigned long counter;	/* Logical timestamp of the block's last access */
+/*
+ * Per-set metadata.
+ * The set lock protects the tags and states of the set's frames, its
+ * replacement policy state and its pending list. Sets are independent, so bios
+ * that hash to different sets are mapped concurrently. The lock is never
+ * taken from interrupt context.
+ * READ hits on VALID blocks do not take the lock; instead, every change that
+ * moves a frame to another block or clears VALID is done inside a write
+ * section of the seqcount, which lockless readers validate against.
+ */
+struct cache_set {
+	spinlock_t set_spin_lock;	/* Lock to protect the set */
+	seqcount_t seq;			/* Changes of frame ownership */
+	struct hlist_head pending;	/* Frames of the set in transition */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Bios that arrive while a cache frame is RESERVED or in WRITEBACK. Only frames
+ * in transition have one of these, so they live on a short list of the set
+ * keyed by cache index rather than in the steady-state per-frame metadata.
+ */
+struct pending_bios {
+	struct hlist_node hash;
+	struct cache_c *dmc;	/* Class of the cache frame */
+	sector_t index;		/* Index of the cache frame */
 	struct bio_list bios;	/* List of pending bios */
 };
 
 /* Structure for a kcached job */
+#define MAX_BLOCK_PAGES	(MAX_BLOCK_SIZE >> (PAGE_SHIFT - SECTOR_SHIFT))
+#define JOB_VECS	(2 * MAX_BLOCK_PAGES + 2)	/* Bio and padding */
+
 struct kcached_job {
-	struct list_head list;
+	struct llist_node node;
+	struct kcached_queue *queue;	/* Queues of the submitting CPU */
 	struct cache_c *dmc;
 	struct bio *bio;	/* Original bio */
 	struct dm_io_region src;
 	struct dm_io_region dest;
-	struct cacheblock *cacheblock;
+	sector_t cache_block;	/* Index of the cache frame */
 	int rw;
 	/*
 	 * When the original bio is not aligned with cache blocks,
-	 * we need extra bvecs and pages for padding.
+	 * we need extra bvecs and pages for padding. They are held in the
+	 * job itself, sized for the largest block; a bio with more segments
+	 * than a block has pages is not cached.
 	 */
-	struct bio_vec *bvec;
+	struct bio_vec bvec[JOB_VECS];
 	unsigned int nr_pages;
-	struct page_list *pages;
+	struct page *page_vec[2 * MAX_BLOCK_PAGES];	/* Pages from the pool */
+	/*
+	 * A READ bio completed before its data were stored leaves them in
+	 * nr_copies pages from the pool, after the padding pages in page_vec,
+	 * at bvec[copy_idx] onward.
+	 */
+	unsigned int copy_idx;
+	unsigned int nr_copies;
+	u32 fill_subs;		/* Sub-blocks a fill has still to copy */
+	int error;		/* The fetch from the source device failed */
+	int flush;		/* A flush waits for this copy */
+};
+
+/*
+ * Replacement policy operations.
+ * The hooks are called with the set lock held, except hit() on a policy that
+ * sets lockless_hit, which is also called from the lockless READ hit path.
+ *  hit:      a block in the frame was accessed
+ *  insert:   a block was placed in the (RESERVED) frame; hint tells whether
+ *            it belongs to a sequential stream
+ *  victim:   pick a frame to replace in a full set, preferring clean frames;
+ *            returns 0 (clean), 2 (dirty, needs write back) or -1 (none)
+ *  evict:    the block in the frame is about to leave the cache
+ *  prefetch: optional; the number of blocks to read ahead of a sequential
+ *            stream at the block. Streams are only tracked for policies that
+ *            have it, and all blocks are inserted as random for the others.
+ */
+#define POLICY_SEQ	1	/* Block belongs to a sequential stream */
+
+struct cache_policy {
+	const char *name;
+	int lockless_hit;	/* hit() does not need the set lock */
+	int (*init)(struct cache_c *dmc);
+	void (*exit)(struct cache_c *dmc);
+	void (*hit)(struct cache_c *dmc, sector_t index);
+	void (*insert)(struct cache_c *dmc, sector_t index, sector_t block,
+	               unsigned int hint);
+	int (*victim)(struct cache_c *dmc, unsigned long set_number,
+	              sector_t block, sector_t *cache_block);
+	void (*evict)(struct cache_c *dmc, sector_t index);
+	unsigned int (*prefetch)(struct cache_c *dmc, sector_t block);
 };
 
 
@@ -160,11 +356,10 @@ static int dm_io_sync_vm(unsigned int num_regions, struct dm_io_region
 	return dm_io(&iorq, num_regions, where, error_bits);
 }
 
-static int dm_io_async_bvec(unsigned int num_regions, struct dm_io_region
-	*where, int rw, struct bio_vec *bvec, io_notify_fn fn, void *context)
+static int dm_io_async_bvec(struct cache_c *dmc, unsigned int num_regions,
+	struct dm_io_region *where, int rw, struct bio_vec *bvec,
+	io_notify_fn fn, void *context)
 {
-	struct kcached_job *job = (struct kcached_job *)context;
-	struct cache_c *dmc = job->dmc;
 	struct dm_io_request iorq;
 
 	iorq.bi_rw = (rw | (1 << REQ_SYNC));
@@ -187,119 +382,237 @@ static int dm_io_async_bvec(unsigned int num_regions, struct dm_io_region
  * Functions for handling pages used by async I/O.
  * The data asked by a bio request may not be aligned with cache blocks, in
  * which case additional pages are required for the request that is forwarded
- * to the server. A pool of pages are reserved for this purpose.
+ * to the server. They come from a pool that starts with DMCACHE_MIN_PAGES
+ * pages, grows on demand up to max_pages, and gives free pages above the
+ * reserve back to the system through a shrinker under memory pressure.
+ * Each CPU keeps up to MAG_PAGES free pages in a magazine of its own; the rest
+ * wait in a depot shared by all CPUs. While the pool is at its ceiling, freed
+ * pages go to the depot, so that no CPU sits on pages another one waits for.
  */
+#define MAG_PAGES	32
 
-static struct page_list *alloc_pl(void)
-{
-	struct page_list *pl;
+struct page_mag {
+	unsigned int nr;
+	struct page *pages[MAG_PAGES];
+};
 
-	pl = kmalloc(sizeof(*pl), GFP_KERNEL);
-	if (!pl)
-		return NULL;
+static inline struct page *depot_pop(struct cache_c *dmc)
+{
+	struct page *page = list_first_entry(&dmc->depot, struct page, lru);
 
-	pl->page = alloc_page(GFP_KERNEL);
-	if (!pl->page) {
-		kfree(pl);
-		return NULL;
-	}
+	list_del(&page->lru);
+	dmc->nr_depot--;
+	return page;
+}
 
-	return pl;
+static inline void depot_push(struct cache_c *dmc, struct page *page)
+{
+	list_add(&page->lru, &dmc->depot);
+	dmc->nr_depot++;
 }
 
-static void free_pl(struct page_list *pl)
+static inline int pool_full(struct cache_c *dmc)
 {
-	__free_page(pl->page);
-	kfree(pl);
+	return atomic_read(&dmc->nr_pages) >= (int)ACCESS_ONCE(dmc->max_pages);
 }
 
-static void drop_pages(struct page_list *pl)
+/*
+ * Give nr pages in vec back to the pool. Pages above a lowered ceiling are
+ * freed.
+ */
+static void kcached_put_pages(struct cache_c *dmc, struct page **vec,
+	                          unsigned int nr)
 {
-	struct page_list *next;
+	struct page_mag *mag;
+	int full;
+
+	while (nr && atomic_read(&dmc->nr_pages) >
+	             (int)ACCESS_ONCE(dmc->max_pages)) {
+		__free_page(vec[--nr]);
+		atomic_dec(&dmc->nr_pages);
+	}
 
-	while (pl) {
-		next = pl->next;
-		free_pl(pl);
-		pl = next;
+	full = pool_full(dmc);
+	mag = get_cpu_ptr(dmc->mags);
+	while (nr && mag->nr < MAG_PAGES && !full)
+		mag->pages[mag->nr++] = vec[--nr];
+	if (nr || (full && mag->nr)) {
+		spin_lock(&dmc->lock);
+		while (nr)
+			depot_push(dmc, vec[--nr]);
+		while (full && mag->nr)
+			depot_push(dmc, mag->pages[--mag->nr]);
+		spin_unlock(&dmc->lock);
 	}
+	put_cpu_ptr(dmc->mags);
 }
 
+/*
+ * Take nr pages from the pool into vec, growing the pool if it has too few
+ * free pages. Returns -ENOMEM, having taken none, if the pool is at its
+ * ceiling or pages cannot be allocated. May sleep.
+ */
 static int kcached_get_pages(struct cache_c *dmc, unsigned int nr,
-	                         struct page_list **pages)
+	                         struct page **vec)
 {
-	struct page_list *pl;
-
-	spin_lock(&dmc->lock);
-	if (dmc->nr_free_pages < nr) {
-		DPRINTK("kcached_get_pages: No free pages: %u<%u",
-		        dmc->nr_free_pages, nr);
+	struct page_mag *mag;
+	struct page *page;
+	unsigned int got = 0;
+
+	mag = get_cpu_ptr(dmc->mags);
+	while (got < nr && mag->nr)
+		vec[got++] = mag->pages[--mag->nr];
+	if (got < nr) {
+		spin_lock(&dmc->lock);
+		while (got < nr && dmc->nr_depot)
+			vec[got++] = depot_pop(dmc);
+		/* Refill the magazine in the same trip, unless pages are short */
+		while (mag->nr < MAG_PAGES / 2 && dmc->nr_depot > MAG_PAGES &&
+		       !pool_full(dmc))
+			mag->pages[mag->nr++] = depot_pop(dmc);
 		spin_unlock(&dmc->lock);
-		return -ENOMEM;
+	}
+	put_cpu_ptr(dmc->mags);
+
+	while (got < nr) { /* Grow the pool */
+		if (atomic_inc_return(&dmc->nr_pages) >
+		    (int)ACCESS_ONCE(dmc->max_pages))
+			goto bad;
+		page = alloc_page(GFP_NOIO | __GFP_NOWARN);
+		if (!page)
+			goto bad;
+		vec[got++] = page;
 	}
 
-	dmc->nr_free_pages -= nr;
-	for (*pages = pl = dmc->pages; --nr; pl = pl->next)
-		;
+	return 0;
 
-	dmc->pages = pl->next;
-	pl->next = NULL;
+bad:
+	atomic_dec(&dmc->nr_pages);
+	DPRINTK("kcached_get_pages: No free pages: %u<%u", got, nr);
+	kcached_put_pages(dmc, vec, got);
+	return -ENOMEM;
+}
 
-	spin_unlock(&dmc->lock);
+/* Free pages in the pool, for reporting; the magazines are read unlocked */
+static unsigned int kcached_free_pages(struct cache_c *dmc)
+{
+	unsigned int nr = ACCESS_ONCE(dmc->nr_depot);
+	int cpu;
 
-	return 0;
+	for_each_possible_cpu(cpu)
+		nr += ACCESS_ONCE(per_cpu_ptr(dmc->mags, cpu)->nr);
+	return nr;
 }
 
-static void kcached_put_pages(struct cache_c *dmc, struct page_list *pl)
+/*
+ * Free depot pages above the reserve under memory pressure, and report how
+ * many are left to free.
+ */
+static int kcached_shrink(struct shrinker *shrink, struct shrink_control *sc)
 {
-	struct page_list *cursor;
+	struct cache_c *dmc = container_of(shrink, struct cache_c, shrinker);
+	unsigned long nr = sc->nr_to_scan;
+	int excess;
 
 	spin_lock(&dmc->lock);
-	for (cursor = pl; cursor->next; cursor = cursor->next)
-		dmc->nr_free_pages++;
+	while (nr && dmc->nr_depot &&
+	       atomic_read(&dmc->nr_pages) > DMCACHE_MIN_PAGES) {
+		__free_page(depot_pop(dmc));
+		atomic_dec(&dmc->nr_pages);
+		nr--;
+	}
+	excess = atomic_read(&dmc->nr_pages) - DMCACHE_MIN_PAGES;
+	excess = min(max(excess, 0), (int)dmc->nr_depot);
+	spin_unlock(&dmc->lock);
 
-	dmc->nr_free_pages++;
-	cursor->next = dmc->pages;
-	dmc->pages = pl;
+	return excess;
+}
 
-	spin_unlock(&dmc->lock);
+static void free_bio_pages(struct cache_c *dmc)
+{
+	struct page_mag *mag;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(dmc->mags, cpu);
+		while (mag->nr)
+			depot_push(dmc, mag->pages[--mag->nr]);
+	}
+	BUG_ON(dmc->nr_depot != atomic_read(&dmc->nr_pages));
+	while (dmc->nr_depot)
+		__free_page(depot_pop(dmc));
+	atomic_set(&dmc->nr_pages, 0);
+	free_percpu(dmc->mags);
+	dmc->mags = NULL;
 }
 
 static int alloc_bio_pages(struct cache_c *dmc, unsigned int nr)
 {
+	struct page *page;
 	unsigned int i;
-	struct page_list *pl = NULL, *next;
+
+	INIT_LIST_HEAD(&dmc->depot);
+	dmc->nr_depot = 0;
+	atomic_set(&dmc->nr_pages, 0);
+	dmc->mags = alloc_percpu(struct page_mag);
+	if (!dmc->mags)
+		return -ENOMEM;
 
 	for (i = 0; i < nr; i++) {
-		next = alloc_pl();
-		if (!next) {
-			if (pl)
-				drop_pages(pl);
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			free_bio_pages(dmc);
 			return -ENOMEM;
 		}
-		next->next = pl;
-		pl = next;
+		depot_push(dmc, page);
+		atomic_inc(&dmc->nr_pages);
 	}
 
-	kcached_put_pages(dmc, pl);
-	dmc->nr_pages += nr;
-
 	return 0;
 }
 
-static void free_bio_pages(struct cache_c *dmc)
-{
-	BUG_ON(dmc->nr_free_pages != dmc->nr_pages);
-	drop_pages(dmc->pages);
-	dmc->pages = NULL;
-	dmc->nr_free_pages = dmc->nr_pages = 0;
-}
+/*
+ * kcached job queues.
+ * Each CPU has its own job lists and work item, shared by all targets. A job
+ * stays on the queues of the CPU that submitted it, so that the work for its
+ * I/O callbacks and its completion runs there, and targets and CPUs do not
+ * funnel through one lock and one thread. A queue whose pages job could not
+ * get pages is marked stalled, and is rerun when a completion returns pages.
+ * The job lists are lock-free: jobs are pushed from any context, and only the
+ * queue's work item takes them off, a whole list at a time.
+ * The fetches of the read misses in a run of I/O jobs are held back until the
+ * run is over, so that misses of adjacent blocks, even in frames far apart,
+ * are read from the source device with one I/O.
+ */
+#define QUEUE_STALLED	0	/* Waiting for pages */
+#define QUEUE_FETCHES	64	/* Most fetches held back at a time */
+#define MAX_COALESCE	8	/* Most fetches merged into one read */
+
+struct kcached_queue {
+	struct llist_head complete_jobs;
+	struct llist_head io_jobs;
+	struct llist_head pages_jobs;
+	struct work_struct work;
+	int cpu;
+	unsigned long flags;
+	unsigned int nr_fetches;
+	struct kcached_job *fetches[QUEUE_FETCHES];	/* Held back fetches */
+};
+
+/* A source read shared by the fetches of adjacent read misses */
+struct fetch_batch {
+	unsigned int nr;
+	struct kcached_job *jobs[MAX_COALESCE];
+	struct bio_vec bvec[MAX_COALESCE * JOB_VECS];
+};
 
 static struct workqueue_struct *_kcached_wq;
-static struct work_struct _kcached_work;
+static struct kcached_queue __percpu *_kcached_queues;
+static atomic_t _stalled_queues;
 
-static inline void wake(void)
+static inline void wake(struct kcached_queue *q)
 {
-	queue_work(_kcached_wq, &_kcached_work);
+	queue_work_on(q->cpu, _kcached_wq, &q->work);
 }
 
 #define MIN_JOBS 1024
@@ -307,14 +620,21 @@ static inline void wake(void)
 static struct kmem_cache *_job_cache;
 static mempool_t *_job_pool;
 
-static DEFINE_SPINLOCK(_job_lock);
+static struct kmem_cache *_pending_cache;
+static mempool_t *_pending_pool;
+
+#define MIN_BATCHES 16
 
-static LIST_HEAD(_complete_jobs);
-static LIST_HEAD(_io_jobs);
-static LIST_HEAD(_pages_jobs);
+static struct kmem_cache *_batch_cache;
+static mempool_t *_batch_pool;
+
+static void do_work(struct work_struct *work);
 
 static int jobs_init(void)
 {
+	struct kcached_queue *q;
+	int cpu;
+
 	_job_cache = kmem_cache_create("kcached-jobs",
 	                               sizeof(struct kcached_job),
 	                               __alignof__(struct kcached_job),
@@ -329,14 +649,87 @@ static int jobs_init(void)
 		return -ENOMEM;
 	}
 
+	_pending_cache = kmem_cache_create("kcached-pending",
+	                                   sizeof(struct pending_bios),
+	                                   __alignof__(struct pending_bios),
+	                                   0, NULL);
+	if (!_pending_cache)
+		goto bad;
+
+	_pending_pool = mempool_create(MIN_JOBS, mempool_alloc_slab,
+	                               mempool_free_slab, _pending_cache);
+	if (!_pending_pool) {
+		kmem_cache_destroy(_pending_cache);
+		goto bad;
+	}
+
+	_batch_cache = kmem_cache_create("kcached-batches",
+	                                 sizeof(struct fetch_batch),
+	                                 __alignof__(struct fetch_batch),
+	                                 0, NULL);
+	if (!_batch_cache)
+		goto bad_pending;
+
+	_batch_pool = mempool_create(MIN_BATCHES, mempool_alloc_slab,
+	                             mempool_free_slab, _batch_cache);
+	if (!_batch_pool) {
+		kmem_cache_destroy(_batch_cache);
+		goto bad_pending;
+	}
+
+	_kcached_queues = alloc_percpu(struct kcached_queue);
+	if (!_kcached_queues) {
+		mempool_destroy(_batch_pool);
+		kmem_cache_destroy(_batch_cache);
+		goto bad_pending;
+	}
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(_kcached_queues, cpu);
+		init_llist_head(&q->complete_jobs);
+		init_llist_head(&q->io_jobs);
+		init_llist_head(&q->pages_jobs);
+		INIT_WORK(&q->work, do_work);
+		q->cpu = cpu;
+		q->flags = 0;
+		q->nr_fetches = 0;
+	}
+	atomic_set(&_stalled_queues, 0);
+
 	return 0;
+
+bad_pending:
+	mempool_destroy(_pending_pool);
+	kmem_cache_destroy(_pending_cache);
+bad:
+	mempool_destroy(_job_pool);
+	kmem_cache_destroy(_job_cache);
+	return -ENOMEM;
 }
 
 static void jobs_exit(void)
 {
-	BUG_ON(!list_empty(&_complete_jobs));
-	BUG_ON(!list_empty(&_io_jobs));
-	BUG_ON(!list_empty(&_pages_jobs));
+	struct kcached_queue *q;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(_kcached_queues, cpu);
+		BUG_ON(!llist_empty(&q->complete_jobs));
+		BUG_ON(!llist_empty(&q->io_jobs));
+		BUG_ON(!llist_empty(&q->pages_jobs));
+		BUG_ON(q->nr_fetches);
+	}
+	free_percpu(_kcached_queues);
+	_kcached_queues = NULL;
+
+	mempool_destroy(_batch_pool);
+	kmem_cache_destroy(_batch_cache);
+	_batch_pool = NULL;
+	_batch_cache = NULL;
+
+	mempool_destroy(_pending_pool);
+	kmem_cache_destroy(_pending_cache);
+	_pending_pool = NULL;
+	_pending_cache = NULL;
 
 	mempool_destroy(_job_pool);
 	kmem_cache_destroy(_job_cache);
@@ -345,31 +738,56 @@ static void jobs_exit(void)
 }
 
 /*
- * Functions to push and pop a job onto the head of a given job list.
+ * Push a job onto a job list of its queue. The list keeps the newest job
+ * first.
  */
-static inline struct kcached_job *pop(struct list_head *jobs)
+static inline void push(struct llist_head *jobs, struct kcached_job *job)
 {
-	struct kcached_job *job = NULL;
-	unsigned long flags;
+	llist_add(&job->node, jobs);
+}
 
-	spin_lock_irqsave(&_job_lock, flags);
+/*
+ * Turn a chain of jobs around, between newest first as pushed and oldest
+ * first as run.
+ */
+static struct llist_node *jobs_reverse(struct llist_node *node)
+{
+	struct llist_node *prev = NULL, *next;
 
-	if (!list_empty(jobs)) {
-		job = list_entry(jobs->next, struct kcached_job, list);
-		list_del(&job->list);
+	while (node) {
+		next = node->next;
+		node->next = prev;
+		prev = node;
+		node = next;
 	}
-	spin_unlock_irqrestore(&_job_lock, flags);
+	return prev;
+}
 
-	return job;
+static void stall(struct kcached_queue *q)
+{
+	if (!test_and_set_bit(QUEUE_STALLED, &q->flags))
+		atomic_inc(&_stalled_queues);
 }
 
-static inline void push(struct list_head *jobs, struct kcached_job *job)
+/*
+ * Rerun the queues waiting for pages. Called after pages are returned.
+ */
+static void wake_stalled(void)
 {
-	unsigned long flags;
+	struct kcached_queue *q;
+	int cpu;
+
+	smp_mb();
+	if (!atomic_read(&_stalled_queues))
+		return;
 
-	spin_lock_irqsave(&_job_lock, flags);
-	list_add_tail(&job->list, jobs);
-	spin_unlock_irqrestore(&_job_lock, flags);
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(_kcached_queues, cpu);
+		if (test_and_clear_bit(QUEUE_STALLED, &q->flags)) {
+			atomic_dec(&_stalled_queues);
+			wake(q);
+		}
+	}
 }
 
 
@@ -385,17 +803,74 @@ static void io_callback(unsigned long error, void *context)
 	struct kcached_job *job = (struct kcached_job *) context;
 
 	if (error) {
-		/* TODO */
 		DMERR("io_callback: io error");
+		if (job->rw == READ) { /* Fetch: do_complete() drops the frame */
+			job->error = 1;
+			push(&job->queue->complete_jobs, job);
+			wake(job->queue);
+		}
+		/* TODO: a failed store */
 		return;
 	}
 
 	if (job->rw == READ) {
 		job->rw = WRITE;
-		push(&_io_jobs, job);
+		push(&job->queue->io_jobs, job);
 	} else
-		push(&_complete_jobs, job);
-	wake();
+		push(&job->queue->complete_jobs, job);
+	wake(job->queue);
+}
+
+/*
+ * Lay out the vector a READ bio's block is fetched into: padding pages around
+ * the bio's own segments, or just the segments if the bio covers the block.
+ * Returns the number of entries.
+ */
+static unsigned int fetch_vecs(struct kcached_job *job, struct bio_vec **vec)
+{
+	struct bio *bio = job->bio;
+	struct cache_c *dmc = job->dmc;
+	unsigned int offset, head, tail, remaining;
+	struct bio_vec *bvec = job->bvec;
+	struct page **pages = job->page_vec;
+	int i, j, k;
+
+	if (0 == job->nr_pages) { /* The request is aligned to cache block */
+		*vec = bio->bi_io_vec + bio->bi_idx;
+		return bio->bi_vcnt - bio->bi_idx;
+	}
+
+	offset = (unsigned int) (bio->bi_sector & dmc->block_mask);
+	head = to_bytes(offset);
+	tail = to_bytes(job->src.count) - bio->bi_size - head;
+
+	i = k = 0;
+	while (head) {
+		bvec[i].bv_len = min(head, (unsigned int)PAGE_SIZE);
+		bvec[i].bv_offset = 0;
+		bvec[i].bv_page = pages[k++];
+		head -= bvec[i].bv_len;
+		i++;
+	}
+
+	remaining = bio->bi_size;
+	j = bio->bi_idx;
+	while (remaining) {
+		bvec[i] = bio->bi_io_vec[j];
+		remaining -= bvec[i].bv_len;
+		i++; j++;
+	}
+
+	while (tail) {
+		bvec[i].bv_len = min(tail, (unsigned int)PAGE_SIZE);
+		bvec[i].bv_offset = 0;
+		bvec[i].bv_page = pages[k++];
+		tail -= bvec[i].bv_len;
+		i++;
+	}
+
+	*vec = bvec;
+	return i;
 }
 
 /*
@@ -409,12 +884,12 @@ static void io_callback(unsigned long error, void *context)
  */
 static int do_fetch(struct kcached_job *job)
 {
-	int r = 0, i, j;
+	int r = 0, i, j, k;
 	struct bio *bio = job->bio;
 	struct cache_c *dmc = job->dmc;
-	unsigned int offset, head, tail, remaining, nr_vecs, idx = 0;
-	struct bio_vec *bvec;
-	struct page_list *pl;
+	unsigned int offset, head, tail, remaining, idx = 0;
+	struct bio_vec *bvec = job->bvec;
+	struct page **pages = job->page_vec;
 	//printk("do_fetch");
 	offset = (unsigned int) (bio->bi_sector & dmc->block_mask);
 	head = to_bytes(offset);
@@ -425,86 +900,27 @@ static int do_fetch(struct kcached_job *job)
 	        job->src.count, head, tail);
 
 	if (bio_data_dir(bio) == READ) { /* The original request is a READ */
-		if (0 == job->nr_pages) { /* The request is aligned to cache block */
-			r = dm_io_async_bvec(1, &job->src, READ,
-			                     bio->bi_io_vec + bio->bi_idx,
-			                     io_callback, job);
-			return r;
-		}
-
-		nr_vecs = bio->bi_vcnt - bio->bi_idx + job->nr_pages;
-		bvec = kmalloc(nr_vecs * sizeof(*bvec), GFP_NOIO);
-		if (!bvec) {
-			DMERR("do_fetch: No memory");
-			return 1;
-		}
-
-		pl = job->pages;
-		i = 0;
-		while (head) {
-			bvec[i].bv_len = min(head, (unsigned int)PAGE_SIZE);
-			bvec[i].bv_offset = 0;
-			bvec[i].bv_page = pl->page;
-			head -= bvec[i].bv_len;
-			pl = pl->next;
-			i++;
-		}
-
-		remaining = bio->bi_size;
-		j = bio->bi_idx;
-		while (remaining) {
-			bvec[i] = bio->bi_io_vec[j];
-			remaining -= bvec[i].bv_len;
-			i++; j++;
-		}
-
-		while (tail) {
-			bvec[i].bv_len = min(tail, (unsigned int)PAGE_SIZE);
-			bvec[i].bv_offset = 0;
-			bvec[i].bv_page = pl->page;
-			tail -= bvec[i].bv_len;
-			pl = pl->next;
-			i++;
-		}
-
-		job->bvec = bvec;
-		r = dm_io_async_bvec(1, &job->src, READ, job->bvec, io_callback, job);
+		fetch_vecs(job, &bvec);
+		r = dm_io_async_bvec(dmc, 1, &job->src, READ, bvec, io_callback, job);
 		return r;
 	} else { /* The original request is a WRITE */
-		pl = job->pages;
-
 		if (head && tail) { /* Special case */
-			bvec = kmalloc(job->nr_pages * sizeof(*bvec), GFP_KERNEL);
-			if (!bvec) {
-				DMERR("do_fetch: No memory");
-				return 1;
-			}
 			for (i=0; i<job->nr_pages; i++) {
 				bvec[i].bv_len = PAGE_SIZE;
 				bvec[i].bv_offset = 0;
-				bvec[i].bv_page = pl->page;
-				pl = pl->next;
+				bvec[i].bv_page = pages[i];
 			}
-			job->bvec = bvec;
-			r = dm_io_async_bvec(1, &job->src, READ, job->bvec,
+			r = dm_io_async_bvec(dmc, 1, &job->src, READ, bvec,
 			                     io_callback, job);
 			return r;
 		}
 
-		bvec = kmalloc((job->nr_pages + bio->bi_vcnt - bio->bi_idx)
-				* sizeof(*bvec), GFP_KERNEL);
-		if (!bvec) {
-			DMERR("do_fetch: No memory");
-			return 1;
-		}
-
-		i = 0;
+		i = k = 0;
 		while (head) {
 			bvec[i].bv_len = min(head, (unsigned int)PAGE_SIZE);
 			bvec[i].bv_offset = 0;
-			bvec[i].bv_page = pl->page;
+			bvec[i].bv_page = pages[k++];
 			head -= bvec[i].bv_len;
-			pl = pl->next;
 			i++;
 		}
 
@@ -521,20 +937,19 @@ static int do_fetch(struct kcached_job *job)
 			bvec[i].bv_offset = (to_bytes(offset) + bio->bi_size) &
 			                    (PAGE_SIZE - 1);
 			bvec[i].bv_len = PAGE_SIZE - bvec[i].bv_offset;
-			bvec[i].bv_page = pl->page;
+			bvec[i].bv_page = pages[k++];
 			tail -= bvec[i].bv_len;
-			pl = pl->next; i++;
+			i++;
 			while (tail) {
 				bvec[i].bv_len = PAGE_SIZE;
 				bvec[i].bv_offset = 0;
-				bvec[i].bv_page = pl->page;
+				bvec[i].bv_page = pages[k++];
 				tail -= bvec[i].bv_len;
-				pl = pl->next; i++;
+				i++;
 			}
 		}
 
-		job->bvec = bvec;
-		r = dm_io_async_bvec(1, &job->src, READ, job->bvec + idx,
+		r = dm_io_async_bvec(dmc, 1, &job->src, READ, bvec + idx,
 		                     io_callback, job);
 		//printk("do_fetch end");
 
@@ -542,6 +957,52 @@ static int do_fetch(struct kcached_job *job)
 	}
 }
 
+/*
+ * Copy the data of a READ bio, just fetched from the source device, into
+ * pages from the pool and complete the bio, so that the application does not
+ * wait for the cache store as well. The frame stays RESERVED until the store
+ * finishes. Returns 0 if the bio was completed, or 1 if the pool is short of
+ * pages, in which case the store goes on from the bio's own pages.
+ */
+static int early_complete(struct kcached_job *job)
+{
+	struct bio *bio = job->bio;
+	struct cache_c *dmc = job->dmc;
+	struct page **copies = job->page_vec + job->nr_pages;
+	struct bio_vec *bvec, *from;
+	unsigned int head, nr, i;
+	void *src;
+
+	nr = bio->bi_vcnt - bio->bi_idx;
+	if (0 == job->nr_pages) /* The store would write the bio's own vecs */
+		job->copy_idx = 0;
+	else {
+		head = to_bytes((unsigned int)(bio->bi_sector & dmc->block_mask));
+		job->copy_idx = dm_div_up(head, PAGE_SIZE);
+	}
+
+	if (kcached_get_pages(dmc, nr, copies))
+		return 1;
+
+	bvec = job->bvec + job->copy_idx;
+	for (i=0; i<nr; i++) {
+		from = bio->bi_io_vec + bio->bi_idx + i;
+		src = kmap_atomic(from->bv_page);
+		memcpy(page_address(copies[i]), src + from->bv_offset,
+		       from->bv_len);
+		kunmap_atomic(src);
+		bvec[i].bv_page = copies[i];
+		bvec[i].bv_offset = 0;
+		bvec[i].bv_len = from->bv_len;
+	}
+	job->nr_copies = nr;
+
+	DPRINTK("Complete read miss %llu before its store", bio->bi_sector);
+	bio_endio(bio, 0);
+	job->bio = NULL;
+	return 0;
+}
+
 /*
  * Store data to the cache source device asynchronously.
  * For a READ bio request, the data fetched from the source device are returned
@@ -554,8 +1015,9 @@ static int do_store(struct kcached_job *job)
 	int i, j, r = 0;
 	struct bio *bio = job->bio ;
 	struct cache_c *dmc = job->dmc;
-	unsigned int offset, head, tail, remaining, nr_vecs;
-	struct bio_vec *bvec;
+	unsigned int offset, head, tail, remaining;
+	struct bio_vec *bvec = job->bvec;
+	struct page **pages = job->page_vec;
 	offset = (unsigned int) (bio->bi_sector & dmc->block_mask);
 	head = to_bytes(offset);
 	tail = to_bytes(dmc->block_size) - bio->bi_size - head;
@@ -564,27 +1026,23 @@ static int do_store(struct kcached_job *job)
 	        bio->bi_sector, job->src.sector, job->dest.sector,
 	        job->src.count, head, tail);
 
+	if (bio_data_dir(bio) == READ && ACCESS_ONCE(dmc->early_read) &&
+	    !early_complete(job))
+		return dm_io_async_bvec(dmc, 1, &job->dest, WRITE, job->bvec,
+		                        io_callback, job);
 
 	if (0 == job->nr_pages) /* Original request is aligned with cache blocks */
-		r = dm_io_async_bvec(1, &job->dest, WRITE, bio->bi_io_vec + bio->bi_idx,
+		r = dm_io_async_bvec(dmc, 1, &job->dest, WRITE, bio->bi_io_vec + bio->bi_idx,
 		                     io_callback, job);
 	else {
 		if (bio_data_dir(bio) == WRITE && head > 0 && tail > 0) {
+			/* Overlay the bio on the block fetched into the pages */
 			DPRINTK("Special case: %lu %u %u", bio_data_dir(bio), head, tail);
-			nr_vecs = job->nr_pages + bio->bi_vcnt - bio->bi_idx;
-			if (offset && (offset + bio->bi_size < PAGE_SIZE)) nr_vecs++;
-			DPRINTK("Create %u new vecs", nr_vecs);
-			bvec = kmalloc(nr_vecs * sizeof(*bvec), GFP_KERNEL);
-			if (!bvec) {
-				DMERR("do_store: No memory");
-				return 1;
-			}
-
 			i = 0;
 			while (head) {
-				bvec[i].bv_len = min(head, job->bvec[i].bv_len);
+				bvec[i].bv_len = min(head, (unsigned int)PAGE_SIZE);
 				bvec[i].bv_offset = 0;
-				bvec[i].bv_page = job->bvec[i].bv_page;
+				bvec[i].bv_page = pages[i];
 				head -= bvec[i].bv_len;
 				i++;
 			}
@@ -599,29 +1057,114 @@ static int do_store(struct kcached_job *job)
 			bvec[i].bv_offset = (to_bytes(offset) + bio->bi_size) -
 			                    j * PAGE_SIZE;
 			bvec[i].bv_len = PAGE_SIZE - bvec[i].bv_offset;
-			bvec[i].bv_page = job->bvec[j].bv_page;
+			bvec[i].bv_page = pages[j];
 			tail -= bvec[i].bv_len;
 			i++; j++;
 			while (tail) {
-				bvec[i] = job->bvec[j];
+				bvec[i].bv_len = PAGE_SIZE;
+				bvec[i].bv_offset = 0;
+				bvec[i].bv_page = pages[j];
 				tail -= bvec[i].bv_len;
 				i++; j++;
 			}
-			kfree(job->bvec);
-			job->bvec = bvec;
 		}
 
-		r = dm_io_async_bvec(1, &job->dest, WRITE, job->bvec, io_callback, job);
+		r = dm_io_async_bvec(dmc, 1, &job->dest, WRITE, job->bvec,
+		                     io_callback, job);
 	}
 	return r;
 }
 
+/* Order held back fetches by target and source sector */
+static int fetch_cmp(const void *a, const void *b)
+{
+	const struct kcached_job *x = *(struct kcached_job * const *)a;
+	const struct kcached_job *y = *(struct kcached_job * const *)b;
+
+	if (x->dmc != y->dmc)
+		return x->dmc < y->dmc ? -1 : 1;
+	if (x->src.sector != y->src.sector)
+		return x->src.sector < y->src.sector ? -1 : 1;
+	return 0;
+}
+
+/* A failed merged read fails the fetch of every job in it */
+static void batch_callback(unsigned long error, void *context)
+{
+	struct fetch_batch *batch = (struct fetch_batch *) context;
+	unsigned int i;
+
+	for (i=0; i<batch->nr; i++)
+		io_callback(error, batch->jobs[i]);
+	mempool_free(batch, _batch_pool);
+}
+
+/*
+ * Fetch the blocks of a run of read misses that are adjacent on the source
+ * device with one read, scattered to the vectors of the jobs. Each job then
+ * stores its own block.
+ */
+static int fetch_run(struct kcached_job **jobs, unsigned int nr)
+{
+	struct cache_c *dmc = jobs[0]->dmc;
+	struct dm_io_region src = jobs[0]->src;
+	struct fetch_batch *batch;
+	struct bio_vec *vec;
+	unsigned int i, len, n = 0;
+
+	batch = mempool_alloc(_batch_pool, GFP_NOIO);
+	batch->nr = nr;
+	for (i=0; i<nr; i++) {
+		batch->jobs[i] = jobs[i];
+		len = fetch_vecs(jobs[i], &vec);
+		memcpy(batch->bvec + n, vec, len * sizeof(*vec));
+		n += len;
+		if (i)
+			src.count += jobs[i]->src.count;
+	}
+	cache_stat_add(dmc, coalesced, nr);
+
+	DPRINTK("fetch_run: %llu(%llu, %u misses)", src.sector, src.count, nr);
+	return dm_io_async_bvec(dmc, 1, &src, READ, batch->bvec,
+	                        batch_callback, batch);
+}
+
+/* Issue the fetches held back on a queue, merging those of adjacent blocks */
+static void fetch_held(struct kcached_queue *q)
+{
+	struct kcached_job **jobs = q->fetches;
+	unsigned int i, j, n = q->nr_fetches;
+	int r;
+
+	q->nr_fetches = 0;
+	sort(jobs, n, sizeof(*jobs), fetch_cmp, NULL);
+	for (i=0; i<n; i=j) {
+		for (j=i+1; j<n && j-i<MAX_COALESCE; j++)
+			if (jobs[j]->dmc != jobs[i]->dmc ||
+			    jobs[j-1]->src.sector + jobs[j-1]->src.count !=
+			    jobs[j]->src.sector)
+				break;
+		if (j - i == 1)
+			r = do_fetch(jobs[i]);
+		else
+			r = fetch_run(jobs + i, j - i);
+		if (r < 0)
+			DMERR("fetch_held: Job processing error");
+	}
+}
+
 static int do_io(struct kcached_job *job)
 {
+	struct kcached_queue *q = job->queue;
 	int r = 0;
 
 	if (job->rw == READ) { /* Read from source device */
-		r = do_fetch(job);
+		if (bio_data_dir(job->bio) == READ) { /* Hold back to merge */
+			if (q->nr_fetches == QUEUE_FETCHES)
+				fetch_held(q);
+			q->fetches[q->nr_fetches++] = job;
+		} else
+			r = do_fetch(job);
 	} else { /* Write to cache device */
 		r = do_store(job);
 	}
@@ -633,78 +1176,319 @@ static int do_pages(struct kcached_job *job)
 {
 	int r = 0;
 
-	r = kcached_get_pages(job->dmc, job->nr_pages, &job->pages);
+	r = kcached_get_pages(job->dmc, job->nr_pages, job->page_vec);
 
-	if (r == -ENOMEM) /* can't complete now */
-		return 1;
+	if (r == -ENOMEM) { /* can't complete now */
+		stall(job->queue);
+		/* Pages may have been returned before the queue was marked */
+		r = kcached_get_pages(job->dmc, job->nr_pages, job->page_vec);
+		if (r == -ENOMEM) {
+			cache_stat_inc(job->dmc, page_stalls);
+			return 1;
+		}
+	}
 
 	/* this job is ready for io */
-	push(&_io_jobs, job);
+	push(&job->queue->io_jobs, job);
 	return 0;
 }
 
+static inline struct cache_set *frame_set(struct cache_c *dmc, sector_t index)
+{
+	return &dmc->cache_sets[(unsigned long)index / dmc->assoc];
+}
+
+/* First sector of a frame on the cache device */
+static inline sector_t frame_sector(struct cache_c *dmc, sector_t index)
+{
+	return dmc->data_start + (index << dmc->block_shift);
+}
+
 /*
- * Flush the bios that are waiting for this cache insertion or write back.
+ * Sub-blocks.
+ * A frame is split into sub-blocks of 1 << sub_shift sectors, at most 32 of
+ * them, so that a write-back write miss covering whole sub-blocks is stored
+ * without first fetching the rest of its block. Such a frame is PARTIAL: only
+ * the sub-blocks in its valid mask are in the cache, and those in its dirty
+ * mask are newer than the source device. The rest is fetched when a bio needs
+ * it, after which the frame is whole again and its masks are no longer used;
+ * a write back copies only the dirty sub-blocks. The masks are changed under
+ * the set lock, and never while the frame is in transition.
+ * Only write-back caches with blocks larger than a sub-block have the masks;
+ * no frame is ever PARTIAL in the others.
  */
-static void flush_bios(struct cacheblock *cacheblock)
+static inline int has_subs(struct cache_c *dmc)
 {
-	struct bio *bio;
-	struct bio *n;
-
-	spin_lock(&cacheblock->lock);
-	bio = bio_list_get(&cacheblock->bios);
-	if (is_state(cacheblock->state, WRITEBACK)) { /* Write back finished */
-		cacheblock->state = VALID;
-	} else { /* Cache insertion finished */
-		set_state(cacheblock->state, VALID);
-		clear_state(cacheblock->state, RESERVED);
-	}
-	spin_unlock(&cacheblock->lock);
+	return dmc->write_policy == WRITE_BACK &&
+	       dmc->block_shift > dmc->sub_shift;
+}
 
-	while (bio) {
-		n = bio->bi_next;
-		bio->bi_next = NULL;
-		DPRINTK("Flush bio: %llu->%llu (%u bytes)",
-		        cacheblock->block, bio->bi_sector, bio->bi_size);
-		generic_make_request(bio);
-		bio = n;
-	}
+/* Mask of sub-blocks [from, to) */
+static inline u32 sub_range(unsigned int from, unsigned int to)
+{
+	return (to - from >= 32 ? ~0U : (1U << (to - from)) - 1) << from;
 }
 
-static int do_complete(struct kcached_job *job)
+/* Mask of all sub-blocks of a frame */
+static inline u32 frame_subs(struct cache_c *dmc)
 {
-	int r = 0;
-	struct bio *bio = job->bio;
+	return sub_range(0, dmc->block_size >> dmc->sub_shift);
+}
 
-	DPRINTK("do_complete: %llu", bio->bi_sector);
+/*
+ * Bios that need sub-blocks of a frame in transition that are not in the
+ * cache, or that found no pending entry for a fill, are parked here. They are
+ * mapped again from the kcached workqueue the next time a transition finishes
+ * and gives back its pending entry. The entries come from one pool for all
+ * caches and classes, so a transition on any of them maps again the bios of
+ * every cache on _requeue_caches.
+ */
+static LIST_HEAD(_requeue_caches);
+static DEFINE_SPINLOCK(_requeue_lock);	/* Protects the list and the bios */
 
-	bio_endio(bio, 0);
+static void requeue_bio(struct cache_c *dmc, struct bio *bio)
+{
+	unsigned long flags;
 
-	if (job->nr_pages > 0) {
-		kfree(job->bvec);
-		kcached_put_pages(job->dmc, job->pages);
-	}
+	spin_lock_irqsave(&_requeue_lock, flags);
+	bio_list_add(&dmc->requeue, bio);
+	if (list_empty(&dmc->requeue_list))
+		list_add_tail(&dmc->requeue_list, &_requeue_caches);
+	spin_unlock_irqrestore(&_requeue_lock, flags);
+}
 
-	flush_bios(job->cacheblock);
-	mempool_free(job, _job_pool);
+static void kick_requeue(void)
+{
+	struct cache_c *dmc, *n;
+	unsigned long flags;
 
-	if (atomic_dec_and_test(&job->dmc->nr_jobs))
-		wake_up(&job->dmc->destroyq);
+	if (list_empty(&_requeue_caches))
+		return;
 
-	return r;
+	spin_lock_irqsave(&_requeue_lock, flags);
+	list_for_each_entry_safe(dmc, n, &_requeue_caches, requeue_list) {
+		list_del_init(&dmc->requeue_list);
+		queue_work(_kcached_wq, &dmc->requeue_work);
+	}
+	spin_unlock_irqrestore(&_requeue_lock, flags);
 }
 
 /*
- * Run through a list for as long as possible.  Returns the count
- * of successful jobs.
+ * Functions for the frames in transition.
+ * A pending entry is added before a frame becomes RESERVED or WRITEBACK and is
+ * removed by flush_bios() when the transition finishes. All of them are called
+ * with the set lock held.
  */
-static int process_jobs(struct list_head *jobs,
-	                    int (*fn) (struct kcached_job *))
+static struct pending_bios *pending_find(struct cache_c *dmc, sector_t index)
 {
+	struct pending_bios *pb;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(pb, pos, &frame_set(dmc, index)->pending, hash)
+		if (pb->index == index && pb->dmc == dmc)
+			return pb;
+
+	return NULL;
+}
+
+/*
+ * The set lock is held, so the entry is taken from the pool's reserve if the
+ * slab cannot satisfy an atomic allocation. Callers treat a failure like a
+ * set with no room and send the bio to the source device.
+ */
+static int pending_add(struct cache_c *dmc, sector_t index)
+{
+	struct pending_bios *pb;
+
+	pb = mempool_alloc(_pending_pool, GFP_ATOMIC);
+	if (!pb)
+		return -ENOMEM;
+	pb->dmc = dmc;
+	pb->index = index;
+	bio_list_init(&pb->bios);
+
+	BUG_ON(pending_find(dmc, index));
+	hlist_add_head(&pb->hash, &frame_set(dmc, index)->pending);
+
+	return 0;
+}
+
+/*
+ * Queue a bio on a frame in transition. A bio without a device is not mapped
+ * yet; it is requeued when the transition finishes.
+ */
+static inline void pending_bio(struct cache_c *dmc, sector_t index,
+	                           struct bio *bio)
+{
+	struct pending_bios *pb = pending_find(dmc, index);
+
+	BUG_ON(!pb);
+	bio_list_add(&pb->bios, bio);
+}
+
+/*
+ * Flush the bios that are waiting for this cache insertion or write back.
+ */
+static void flush_bios(struct cache_c *dmc, sector_t index)
+{
+	struct cache_set *set = frame_set(dmc, index);
+	struct pending_bios *pb;
+	struct bio *bio;
+	struct bio *n;
+
+	spin_lock(&set->set_spin_lock);
+	pb = pending_find(dmc, index);
+	BUG_ON(!pb);
+	hlist_del(&pb->hash);
+	bio = bio_list_get(&pb->bios);
+	if (is_state(dmc->states[index], WRITEBACK)) { /* Write back finished */
+		dmc->states[index] = VALID | (dmc->states[index] & PARTIAL);
+	} else { /* Cache insertion finished */
+		set_state(dmc->states[index], VALID);
+		clear_state(dmc->states[index], RESERVED);
+	}
+	spin_unlock(&set->set_spin_lock);
+	mempool_free(pb, _pending_pool);
+
+	while (bio) {
+		n = bio->bi_next;
+		bio->bi_next = NULL;
+		DPRINTK("Flush bio: %llu->%llu (%u bytes)",
+		        dmc->tags[index], bio->bi_sector, bio->bi_size);
+		if (bio->bi_bdev)
+			generic_make_request(bio);
+		else
+			requeue_bio(dmc, bio);
+		bio = n;
+	}
+	kick_requeue();
+}
+
+/*
+ * A fill of a RESERVED frame from the source device failed. Drop the frame and
+ * send the bios waiting for it to the source device instead. Bios that were
+ * remapped to the frame get back their offset from its first sector, which
+ * need not be aligned to the block size; the others still address the source.
+ */
+static void abort_fill(struct cache_c *dmc, sector_t index)
+{
+	struct cache_set *set = frame_set(dmc, index);
+	struct pending_bios *pb;
+	struct bio *bio;
+	struct bio *n;
+	sector_t block;
+
+	spin_lock(&set->set_spin_lock);
+	pb = pending_find(dmc, index);
+	BUG_ON(!pb);
+	hlist_del(&pb->hash);
+	bio = bio_list_get(&pb->bios);
+	if (is_state(dmc->states[index], DIRTY))
+		cache_stat_add(dmc, dirty_blocks, -1);
+	dmc->policy->evict(dmc, index);
+	if (dmc->pf_tags[index]) {
+		dmc->pf_tags[index] = 0;
+		atomic_dec(&dmc->pf_frames);
+	}
+	write_seqcount_begin(&set->seq);
+	dmc->states[index] = INVALID;
+	write_seqcount_end(&set->seq);
+	block = dmc->tags[index];
+	spin_unlock(&set->set_spin_lock);
+	mempool_free(pb, _pending_pool);
+
+	while (bio) {
+		n = bio->bi_next;
+		bio->bi_next = NULL;
+		if (bio->bi_bdev) /* Remapped to the frame */
+			bio->bi_sector = block + bio->bi_sector -
+			                 frame_sector(dmc, index);
+		bio->bi_bdev = dmc->src_dev->bdev;
+		generic_make_request(bio);
+		bio = n;
+	}
+	kick_requeue();
+}
+
+/*
+ * A fill of a PARTIAL frame from the source device failed. Unlike a fresh
+ * frame, it holds the only copy of its dirty sub-blocks, so it is kept as it
+ * was; the bios that waited for the missing sub-blocks fail.
+ */
+static void abort_partial_fill(struct cache_c *dmc, sector_t index)
+{
+	struct cache_set *set = frame_set(dmc, index);
+	struct pending_bios *pb;
+	struct bio *bio;
+	struct bio *n;
+
+	spin_lock(&set->set_spin_lock);
+	pb = pending_find(dmc, index);
+	BUG_ON(!pb);
+	hlist_del(&pb->hash);
+	bio = bio_list_get(&pb->bios);
+	clear_state(dmc->states[index], RESERVED);
+	spin_unlock(&set->set_spin_lock);
+	mempool_free(pb, _pending_pool);
+
+	while (bio) {
+		n = bio->bi_next;
+		bio->bi_next = NULL;
+		bio_endio(bio, -EIO);
+		bio = n;
+	}
+	kick_requeue();
+}
+
+static int do_complete(struct kcached_job *job)
+{
+	int r = 0;
+	struct bio *bio = job->bio;
+
+	if (job->error) { /* The fetch failed; read or write the source */
+		DPRINTK("do_complete: %llu (fetch failed)", bio->bi_sector);
+		bio->bi_bdev = job->dmc->src_dev->bdev;
+		generic_make_request(bio);
+	} else if (job->nr_copies) { /* The bio completed when its data were fetched */
+		DPRINTK("do_complete: %llu (early)", job->src.sector);
+	} else {
+		DPRINTK("do_complete: %llu", bio->bi_sector);
+		bio_endio(bio, 0);
+	}
+
+	if (job->nr_pages + job->nr_copies > 0) {
+		kcached_put_pages(job->dmc, job->page_vec,
+		                  job->nr_pages + job->nr_copies);
+		wake_stalled();
+	}
+
+	if (job->error)
+		abort_fill(job->dmc, job->cache_block);
+	else
+		flush_bios(job->dmc, job->cache_block);
+	mempool_free(job, _job_pool);
+
+	if (atomic_dec_and_test(&job->dmc->nr_jobs))
+		wake_up(&job->dmc->destroyq);
+
+	return r;
+}
+
+/*
+ * Run through a list for as long as possible, taking all of its jobs at once.
+ * Returns the count of successful jobs.
+ */
+static int process_jobs(struct llist_head *jobs,
+	                    int (*fn) (struct kcached_job *))
+{
+	struct llist_node *node, *next;
 	struct kcached_job *job;
 	int r, count = 0;
 
-	while ((job = pop(jobs))) {
+	node = jobs_reverse(llist_del_all(jobs));
+	while (node) {
+		next = node->next; /* fn() may push the job onto another list */
+		job = llist_entry(node, struct kcached_job, node);
 		r = fn(job);
 
 		if (r < 0) {
@@ -714,51 +1498,68 @@ static int process_jobs(struct list_head *jobs,
 
 		if (r > 0) {
 			/*
-			 * We couldn't service this job ATM, so
-			 * push this job back onto the list.
+			 * We couldn't service this job ATM, so push it and
+			 * the rest of the batch back onto the list.
 			 */
-			push(jobs, job);
+			llist_add_batch(jobs_reverse(node), node, jobs);
 			break;
 		}
 
 		count++;
+		node = next;
 	}
 
 	return count;
 }
 
-static void do_work(struct work_struct *ignored)
+static void do_work(struct work_struct *work)
 {
-	process_jobs(&_complete_jobs, do_complete);
-	process_jobs(&_pages_jobs, do_pages);
-	process_jobs(&_io_jobs, do_io);
+	struct kcached_queue *q = container_of(work, struct kcached_queue, work);
+
+	process_jobs(&q->complete_jobs, do_complete);
+	process_jobs(&q->pages_jobs, do_pages);
+	process_jobs(&q->io_jobs, do_io);
+	if (q->nr_fetches)
+		fetch_held(q);
 }
 
 static void queue_job(struct kcached_job *job)
 {
 	atomic_inc(&job->dmc->nr_jobs);
+	job->queue = per_cpu_ptr(_kcached_queues, get_cpu());
 	if (job->nr_pages > 0) /* Request pages */
-		push(&_pages_jobs, job);
+		push(&job->queue->pages_jobs, job);
 	else /* Go ahead to do I/O */
-		push(&_io_jobs, job);
-	wake();
+		push(&job->queue->io_jobs, job);
+	wake(job->queue);
+	put_cpu();
 }
 
+static void do_requeue(struct work_struct *work);
+
 static int kcached_init(struct cache_c *dmc)
 {
 	int r;
 
 	spin_lock_init(&dmc->lock);
-	dmc->pages = NULL;
-	dmc->nr_pages = dmc->nr_free_pages = 0;
-	r = alloc_bio_pages(dmc, DMCACHE_COPY_PAGES);
+	dmc->max_pages = DMCACHE_COPY_PAGES;
+	r = alloc_bio_pages(dmc, DMCACHE_MIN_PAGES);
 	if (r) {
 		DMERR("kcached_init: Could not allocate bio pages");
 		return r;
 	}
+	dmc->shrinker.shrink = kcached_shrink;
+	dmc->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&dmc->shrinker);
 
 	init_waitqueue_head(&dmc->destroyq);
 	atomic_set(&dmc->nr_jobs, 0);
+	init_waitqueue_head(&dmc->flushq);
+	atomic_set(&dmc->nr_flushing, 0);
+
+	INIT_LIST_HEAD(&dmc->requeue_list);
+	bio_list_init(&dmc->requeue);
+	INIT_WORK(&dmc->requeue_work, do_requeue);
 
 	return 0;
 }
@@ -767,7 +1568,12 @@ void kcached_client_destroy(struct cache_c *dmc)
 {
 	/* Wait for completion of all jobs submitted by this client. */
 	wait_event(dmc->destroyq, !atomic_read(&dmc->nr_jobs));
+	spin_lock_irq(&_requeue_lock);
+	list_del_init(&dmc->requeue_list);
+	spin_unlock_irq(&_requeue_lock);
+	cancel_work_sync(&dmc->requeue_work);
 
+	unregister_shrinker(&dmc->shrinker);
 	free_bio_pages(dmc);
 }
 
@@ -780,500 +1586,3208 @@ void kcached_client_destroy(struct cache_c *dmc)
  * the number of reserved pages.
  ****************************************************************************/
 
-static void copy_callback(int read_err, unsigned int write_err, void *context)
+/*
+ * A write back copy issued by a flush has finished. dm_kcopyd_client_destroy()
+ * waits for the callbacks, so dmc is still there after the count drops.
+ */
+static void wb_copy_done(struct cache_c *dmc)
 {
-	struct cacheblock *cacheblock = (struct cacheblock *) context;
+	atomic_dec(&dmc->nr_flushing);
+	wake_up(&dmc->flushq);
+}
 
-	flush_bios(cacheblock);
+/*
+ * The kcopyd context is a kcached_job whose src region covers the cache frames
+ * being written back or prefetched, so that every frame of the run can be
+ * released. Frames whose prefetch failed are dropped.
+ */
+static void copy_callback(int read_err, unsigned int write_err, void *context)
+{
+	struct kcached_job *job = (struct kcached_job *) context;
+	struct cache_c *dmc = job->dmc;
+	sector_t i, length = job->src.count >> dmc->block_shift;
+	int fill = job->dest.bdev == dmc->cache_dev->bdev, flush = job->flush;
+
+	if (read_err || write_err)
+		DMERR("%s of frame %llu failed",
+		      fill ? "Prefetch" : "Write back", job->cache_block);
+	for (i=0; i<length; i++) {
+		if (fill && (read_err || write_err))
+			abort_fill(dmc, job->cache_block + i);
+		else
+			flush_bios(dmc, job->cache_block + i);
+	}
+	mempool_free(job, _job_pool);
+	if (flush)
+		wb_copy_done(dmc);
 }
 
 static void copy_block(struct cache_c *dmc, struct dm_io_region src,
-	                   struct dm_io_region dest, struct cacheblock *cacheblock)
+	                   struct dm_io_region dest, sector_t cache_block,
+	                   int flush)
 {
+	struct kcached_job *job;
+
 	DPRINTK("Copying: %llu:%llu->%llu:%llu",
 			src.sector, src.count * 512, dest.sector, dest.count * 512);
+	job = mempool_alloc(_job_pool, GFP_NOIO);
+	job->dmc = dmc;
+	job->bio = NULL;
+	job->src = src;
+	job->dest = dest;
+	job->cache_block = cache_block;
+	job->flush = flush;
 	dm_kcopyd_copy(dmc->kcp_client, &src, 1, &dest, 0, \
-			(dm_kcopyd_notify_fn) copy_callback, (void *)cacheblock);
+			(dm_kcopyd_notify_fn) copy_callback, (void *)job);
 }
 
-static void write_back(struct cache_c *dmc, sector_t index, unsigned int length)
+/*
+ * Mark a run of dirty frames of one set for write back. Called with the set
+ * lock held; returns the number of frames marked, which is less than length
+ * only if pending entries run out.
+ */
+static unsigned int prepare_write_back(struct cache_c *dmc, sector_t index,
+	                                   unsigned int length)
 {
-	struct dm_io_region src, dest;
-	struct cacheblock *cacheblock = &dmc->cache[index];
 	unsigned int i;
 
+	for (i=0; i<length; i++) {
+		if (pending_add(dmc, index + i))
+			break;
+		set_state(dmc->states[index+i], WRITEBACK);
+	}
+	cache_stat_add(dmc, dirty_blocks, -(long)i);
+
+	return i;
+}
+
+/* Copy a run of whole frames in WRITEBACK to the source device */
+static void write_back_run(struct cache_c *dmc, sector_t index,
+	                       unsigned int length, int flush)
+{
+	struct dm_io_region src, dest;
+
 	DPRINTK("Write back block %llu(%llu, %u)",
-	        index, cacheblock->block, length);
+	        index, dmc->tags[index], length);
 	src.bdev = dmc->cache_dev->bdev;
-	src.sector = index << dmc->block_shift;
+	src.sector = frame_sector(dmc, index);
 	src.count = dmc->block_size * length;
 	dest.bdev = dmc->src_dev->bdev;
-	dest.sector = cacheblock->block;
+	dest.sector = dmc->tags[index];
 	dest.count = dmc->block_size * length;
 
-	for (i=0; i<length; i++)
-		set_state(dmc->cache[index+i].state, WRITEBACK);
-	dmc->dirty_blocks -= length;
-	copy_block(dmc, src, dest, cacheblock);
+	copy_block(dmc, src, dest, index, flush);
 }
 
-
-/****************************************************************************
- *  Functions for implementing the various cache operations.
- ****************************************************************************/
+static void copy_subs_run(struct kcached_job *job);
 
 /*
- * Map a block from the source device to a block in the cache device.
+ * The runs of sub-blocks of a PARTIAL frame are copied one after another. A
+ * fill (READ) makes the frame whole and releases the bios waiting for it; a
+ * write back (WRITE) of the dirty runs leaves it PARTIAL and clean.
  */
-static unsigned long hash_block(struct cache_c *dmc, sector_t block)
+static void copy_subs_callback(int read_err, unsigned int write_err,
+	                           void *context)
 {
-	unsigned long set_number, value;
+	struct kcached_job *job = (struct kcached_job *) context;
+	struct cache_c *dmc = job->dmc;
+	struct cache_set *set = frame_set(dmc, job->cache_block);
+	int flush = job->flush;
+
+	if (read_err || write_err) {
+		DMERR("%s of frame %llu failed",
+		      job->rw == READ ? "Fill" : "Write back", job->cache_block);
+		if (job->rw == READ)
+			abort_partial_fill(dmc, job->cache_block);
+		else
+			flush_bios(dmc, job->cache_block);
+		mempool_free(job, _job_pool);
+		if (flush)
+			wb_copy_done(dmc);
+		return;
+	}
 
-	value = (unsigned long)(block >> (dmc->block_shift +
-	        dmc->consecutive_shift));
-	set_number = hash_long(value, dmc->bits) / dmc->assoc;
+	if (job->fill_subs) {
+		copy_subs_run(job);
+		return;
+	}
 
- 	return set_number;
+	if (job->rw == READ) {
+		spin_lock(&set->set_spin_lock);
+		clear_state(dmc->states[job->cache_block], PARTIAL);
+		spin_unlock(&set->set_spin_lock);
+	}
+	flush_bios(dmc, job->cache_block);
+	mempool_free(job, _job_pool);
+	if (flush)
+		wb_copy_done(dmc);
+}
+
+static void copy_subs_run(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	unsigned int first = __ffs(job->fill_subs), last = first + 1;
+	struct dm_io_region *src, *cache;
+	sector_t left;
+
+	while (last < 32 && (job->fill_subs & (1U << last)))
+		last++;
+	job->fill_subs &= ~sub_range(first, last);
+
+	src = job->rw == READ ? &job->src : &job->dest;
+	cache = job->rw == READ ? &job->dest : &job->src;
+	src->bdev = dmc->src_dev->bdev;
+	src->sector = dmc->tags[job->cache_block] + (first << dmc->sub_shift);
+	src->count = (last - first) << dmc->sub_shift;
+	left = (dmc->src_dev->bdev->bd_inode->i_size>>9) - src->sector;
+	if (left < src->count)
+		src->count = left;
+	cache->bdev = dmc->cache_dev->bdev;
+	cache->sector = frame_sector(dmc, job->cache_block) +
+	                (first << dmc->sub_shift);
+	cache->count = src->count;
+
+	DPRINTK("Copying sub-blocks: %llu:%llu->%llu:%llu", job->src.sector,
+	        job->src.count, job->dest.sector, job->dest.count);
+	dm_kcopyd_copy(dmc->kcp_client, &job->src, 1, &job->dest, 0,
+	               (dm_kcopyd_notify_fn) copy_subs_callback, (void *)job);
 }
 
 /*
- * Reset the LRU counters (the cache's global counter and each cache block's
- * counter). This seems to be a naive implementaion. However, consider the
- * rareness of this event, it might be more efficient that other more complex
- * schemes. TODO: a more elegant solution.
+ * Copy the missing sub-blocks of a PARTIAL frame from the source device
+ * (READ), or its dirty ones to the source device (WRITE). The frame is in
+ * transition, so its masks do not change meanwhile. Called without the set
+ * lock, as kcopyd may sleep.
  */
-static void cache_reset_counter(struct cache_c *dmc)
+static void copy_subs(struct cache_c *dmc, sector_t index, int rw, int flush)
 {
-	sector_t i;
-	struct cacheblock *cache = dmc->cache;
+	struct kcached_job *job;
+	sector_t left;
+
+	job = mempool_alloc(_job_pool, GFP_NOIO);
+	job->dmc = dmc;
+	job->bio = NULL;
+	job->cache_block = index;
+	job->rw = rw;
+	job->flush = flush;
+	if (rw == READ) {
+		job->fill_subs = frame_subs(dmc) & ~dmc->sub_valid[index];
+		cache_stat_inc(dmc, fills);
+	} else
+		job->fill_subs = dmc->sub_dirty[index];
 
-	DPRINTK("Reset LRU counters");
-	for (i=0; i<dmc->size; i++)
-		cache[i].counter = 0;
+	/* Nothing to copy past the end of the source device */
+	left = (dmc->src_dev->bdev->bd_inode->i_size>>9) - dmc->tags[index];
+	if (left < dmc->block_size)
+		job->fill_subs &= sub_range(0, dm_div_up((unsigned int)left,
+		                                         1 << dmc->sub_shift));
 
-	dmc->counter = 0;
+	if (job->fill_subs)
+		copy_subs_run(job);
+	else
+		copy_subs_callback(0, 0, job);
 }
 
 /*
- * Lookup a block in the cache.
- *
- * Return value:
- *  1: cache hit (cache_block stores the index of the matched block)
- *  0: cache miss but frame is allocated for insertion; cache_block stores the
- *     frame's index:
- *      If there are empty frames, then the first encounted is used.
- *      If there are clean frames, then the LRU clean block is replaced.
- *  2: cache miss and frame is not allocated; cache_block stores the LRU dirty
- *     block's index:
- *      This happens when the entire set is dirty.
- * -1: cache miss and no room for insertion:
- *      This happens when the entire set in transition modes (RESERVED or
- *      WRITEBACK).
- *
+ * Copy a run of frames marked by prepare_write_back() to the source device.
+ * Only the dirty sub-blocks of PARTIAL frames are written, frame by frame.
+ * kcopyd may sleep, so this is called without the set lock. If flush is set,
+ * the caller counted the copy in nr_flushing.
  */
-static int cache_lookup(struct cache_c *dmc, sector_t block,
-	                    sector_t *cache_block)
+static void write_back(struct cache_c *dmc, sector_t index, unsigned int length,
+	                   int flush)
 {
-	unsigned long set_number = hash_block(dmc, block);
-	sector_t index;
-	int i, res;
-	unsigned int cache_assoc = dmc->assoc;
-	struct cacheblock *cache = dmc->cache;
-	int invalid = -1, oldest = -1, oldest_clean = -1;
-	unsigned long counter = ULONG_MAX, clean_counter = ULONG_MAX;
-
-	index=set_number * cache_assoc;
-
-	for (i=0; i<cache_assoc; i++, index++) {
-		if (is_state(cache[index].state, VALID) ||
-		    is_state(cache[index].state, RESERVED)) {
-			if (cache[index].block == block) {
-				*cache_block = index;
-				/* Reset all counters if the largest one is going to overflow */
-				if (dmc->counter == ULONG_MAX) cache_reset_counter(dmc);
-				cache[index].counter = ++dmc->counter;
-				break;
-			} else {
-				/* Don't consider blocks that are in the middle of copying */
-				if (!is_state(cache[index].state, RESERVED) &&
-				    !is_state(cache[index].state, WRITEBACK)) {
-					if (!is_state(cache[index].state, DIRTY) &&
-					    cache[index].counter < clean_counter) {
-						clean_counter = cache[index].counter;
-						oldest_clean = i;
-					}
-					if (cache[index].counter < counter) {
-						counter = cache[index].counter;
-						oldest = i;
-					}
-				}
-			}
-		} else {
-			if (-1 == invalid) invalid = i;
-		}
-	}
+	unsigned int i, j;
 
-	res = i < cache_assoc ? 1 : 0;
-	if (!res) { /* Cache miss */
-		if (invalid != -1) /* Choose the first empty frame */
-			*cache_block = set_number * cache_assoc + invalid;
-		else if (oldest_clean != -1) /* Choose the LRU clean block to replace */
-			*cache_block = set_number * cache_assoc + oldest_clean;
-		else if (oldest != -1) { /* Choose the LRU dirty block to evict */
-			res = 2;
-			*cache_block = set_number * cache_assoc + oldest;
-		} else {
-			res = -1;
+	for (i=0; i<length; i=j) {
+		j = i + 1;
+		if (is_state(dmc->states[index+i], PARTIAL)) {
+			copy_subs(dmc, index + i, WRITE, flush);
+			continue;
 		}
+		while (j < length && !is_state(dmc->states[index+j], PARTIAL))
+			j++;
+		write_back_run(dmc, index + i, j - i, flush);
 	}
-
-	if (-1 == res)
-		DPRINTK("Cache lookup: Block %llu(%lu):%s",
-	            block, set_number, "NO ROOM");
-	else
-		DPRINTK("Cache lookup: Block %llu(%lu):%llu(%s)",
-		        block, set_number, *cache_block,
-		        1 == res ? "HIT" : (0 == res ? "MISS" : "WB NEEDED"));
-	return res;
 }
 
+
 /*
- * Insert a block into the cache (in the frame specified by cache_block).
+ * Flush writes.
+ * A flush writes dirty frames back in the order of their source blocks. The
+ * frames of a run of consecutive source blocks, wherever they are in the
+ * cache, are read into pages from the pool and written to the source device
+ * with one I/O.
  */
-static int cache_insert(struct cache_c *dmc, sector_t block,
-	                    sector_t cache_block)
-{
-	struct cacheblock *cache = dmc->cache;
+#define WB_RUN_PAGES	(WB_RUN_SECTORS >> (PAGE_SHIFT - SECTOR_SHIFT))
 
-	/* Mark the block as RESERVED because although it is allocated, the data are
-       not in place until kcopyd finishes its job.
-	 */
-	cache[cache_block].block = block;
-	cache[cache_block].state = RESERVED;
-	if (dmc->counter == ULONG_MAX) cache_reset_counter(dmc);
-	cache[cache_block].counter = ++dmc->counter;
+struct wb_frame {
+	sector_t block;		/* Source block */
+	sector_t index;		/* Index of the cache frame */
+};
 
-	return 1;
+struct wb_run {
+	struct cache_c *dmc;
+	struct work_struct work;
+	sector_t block;		/* First source block */
+	unsigned int nr;	/* Number of frames */
+	unsigned int nr_pages;
+	atomic_t reads;		/* Frame reads not done yet */
+	unsigned long error;
+	sector_t index[WB_RUN_PAGES];
+	struct page *pages[WB_RUN_PAGES];
+	struct bio_vec bvec[WB_RUN_PAGES];
+};
+
+static void wb_done(struct work_struct *work)
+{
+	struct wb_run *run = container_of(work, struct wb_run, work);
+	struct cache_c *dmc = run->dmc;
+	unsigned int i;
+
+	if (run->error)
+		DMERR("Write back of block %llu failed", run->block);
+	for (i=0; i<run->nr; i++)
+		flush_bios(dmc, run->index[i]);
+	kcached_put_pages(dmc, run->pages, run->nr_pages);
+	wake_stalled();
+	kfree(run);
+
+	/* Both the flush and wb_issue() wait for runs to finish */
+	atomic_dec(&dmc->nr_flushing);
+	wake_up(&dmc->flushq);
 }
 
-/*
- * Invalidate a block (specified by cache_block) in the cache.
- */
-static void cache_invalidate(struct cache_c *dmc, sector_t cache_block)
+static void wb_write_callback(unsigned long error, void *context)
 {
-	struct cacheblock *cache = dmc->cache;
+	struct wb_run *run = (struct wb_run *) context;
 
-	DPRINTK("Cache invalidate: Block %llu(%llu)",
-	        cache_block, cache[cache_block].block);
-	clear_state(cache[cache_block].state, VALID);
+	run->error = error;
+	INIT_WORK(&run->work, wb_done);
+	queue_work(_kcached_wq, &run->work);
 }
 
-/*
- * Handle a cache hit:
- *  For READ, serve the request from cache is the block is ready; otherwise,
- *  queue the request for later processing.
- *  For write, invalidate the cache block if write-through. If write-back,
- *  serve the request from cache if the block is ready, or queue the request
- *  for later processing if otherwise.
- */
-static int cache_hit(struct cache_c *dmc, struct bio* bio, sector_t cache_block)
+static void wb_write(struct work_struct *work)
 {
-	unsigned int offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
-	struct cacheblock *cache = dmc->cache;
+	struct wb_run *run = container_of(work, struct wb_run, work);
+	struct cache_c *dmc = run->dmc;
+	struct dm_io_region dest;
+	sector_t left;
 
-	dmc->cache_hits++;
+	if (run->error) {
+		wb_done(work);
+		return;
+	}
 
-	if (bio_data_dir(bio) == READ) { /* READ hit */
-		bio->bi_bdev = dmc->cache_dev->bdev;
-		bio->bi_sector = (cache_block << dmc->block_shift)  + offset;
+	dest.bdev = dmc->src_dev->bdev;
+	dest.sector = run->block;
+	dest.count = dmc->block_size * run->nr;
+	left = (dmc->src_dev->bdev->bd_inode->i_size>>9) - run->block;
+	if (left < dest.count)
+		dest.count = left;
+
+	DPRINTK("Write back run %llu(%u frames)", run->block, run->nr);
+	dm_io_async_bvec(dmc, 1, &dest, WRITE, run->bvec, wb_write_callback,
+	                 run);
+}
 
-		spin_lock(&cache[cache_block].lock);
+static void wb_read_callback(unsigned long error, void *context)
+{
+	struct wb_run *run = (struct wb_run *) context;
 
-		if (is_state(cache[cache_block].state, VALID)) { /* Valid cache block */
-			spin_unlock(&cache[cache_block].lock);
-			return 1;
-		}
+	if (error)
+		run->error = error;
+	if (atomic_dec_and_test(&run->reads)) {
+		INIT_WORK(&run->work, wb_write);
+		queue_work(_kcached_wq, &run->work);
+	}
+}
 
-		/* Cache block is not ready yet */
-		DPRINTK("Add to bio list %s(%llu)",
-				dmc->cache_dev->name, bio->bi_sector);
-		bio_list_add(&cache[cache_block].bios, bio);
+/*
+ * Write back a frame marked by prepare_write_back() with kcopyd: a PARTIAL
+ * frame, or one of a run the pool has no pages for. Until wb_copy_done(), it
+ * counts as a run in flight.
+ */
+static void wb_copy(struct cache_c *dmc, sector_t index)
+{
+	wait_event(dmc->flushq,
+	           atomic_read(&dmc->nr_flushing) < WB_MAX_RUNS);
+	atomic_inc(&dmc->nr_flushing);
+	write_back(dmc, index, 1, 1);
+}
 
-		spin_unlock(&cache[cache_block].lock);
-		return 0;
-	} else { /* WRITE hit */
-		if (dmc->write_policy == WRITE_THROUGH) { /* Invalidate cached data */
-			cache_invalidate(dmc, cache_block);
-			bio->bi_bdev = dmc->src_dev->bdev;
-			return 1;
+/*
+ * Write back a run of frames marked by prepare_write_back(), holding
+ * consecutive source blocks. At most WB_MAX_RUNS runs are in flight; if the
+ * pool has no pages for one, the frames are copied by kcopyd instead.
+ */
+static void wb_issue(struct cache_c *dmc, struct wb_frame *frames,
+	                 unsigned int nr)
+{
+	unsigned int per = dm_div_up(to_bytes(dmc->block_size), PAGE_SIZE);
+	unsigned int i, j, k, left;
+	struct dm_io_region src;
+	struct wb_run *run;
+
+	wait_event(dmc->flushq,
+	           atomic_read(&dmc->nr_flushing) < WB_MAX_RUNS);
+
+	run = kmalloc(sizeof(*run), GFP_NOIO);
+	if (run && kcached_get_pages(dmc, nr * per, run->pages)) {
+		/* Wait for the runs in flight to give their pages back */
+		wait_event(dmc->flushq, !atomic_read(&dmc->nr_flushing));
+		if (kcached_get_pages(dmc, nr * per, run->pages)) {
+			kfree(run);
+			run = NULL;
 		}
+	}
+	if (!run) {
+		for (i=0; i<nr; i++)
+			wb_copy(dmc, frames[i].index);
+		return;
+	}
 
-		/* Write delay */
-		if (!is_state(cache[cache_block].state, DIRTY)) {
-			set_state(cache[cache_block].state, DIRTY);
-			dmc->dirty_blocks++;
+	run->dmc = dmc;
+	run->block = frames[0].block;
+	run->nr = nr;
+	run->nr_pages = nr * per;
+	run->error = 0;
+	atomic_set(&run->reads, nr);
+	for (i=0, k=0; i<nr; i++) {
+		run->index[i] = frames[i].index;
+		left = to_bytes(dmc->block_size);
+		for (j=0; j<per; j++, k++) {
+			run->bvec[k].bv_page = run->pages[k];
+			run->bvec[k].bv_offset = 0;
+			run->bvec[k].bv_len = min(left, (unsigned int)PAGE_SIZE);
+			left -= run->bvec[k].bv_len;
 		}
+	}
 
-		spin_lock(&cache[cache_block].lock);
+	atomic_inc(&dmc->nr_flushing);
+	src.bdev = dmc->cache_dev->bdev;
+	src.count = dmc->block_size;
+	for (i=0; i<nr; i++) {
+		src.sector = frame_sector(dmc, run->index[i]);
+		dm_io_async_bvec(dmc, 1, &src, READ, run->bvec + i * per,
+		                 wb_read_callback, run);
+	}
+}
+
+static int wb_frame_cmp(const void *a, const void *b)
+{
+	const struct wb_frame *x = a, *y = b;
+
+	if (x->block != y->block)
+		return x->block < y->block ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write back a batch of dirty frames sorted by source block. Returns the
+ * number of frames marked for write back.
+ */
+static sector_t wb_frames(struct cache_c *dmc, struct wb_frame *frames,
+	                      sector_t nr)
+{
+	unsigned int per = dm_div_up(to_bytes(dmc->block_size), PAGE_SIZE);
+	sector_t i, j, n = 0;
+	struct cache_set *set;
+	u8 state;
+
+	for (i=0, j=0; i<nr; i++) {
+		set = frame_set(dmc, frames[i].index);
+		spin_lock(&set->set_spin_lock);
+		state = dmc->states[frames[i].index];
+		if (!is_state(state, DIRTY) || is_state(state, WRITEBACK) ||
+		    dmc->tags[frames[i].index] != frames[i].block ||
+		    !prepare_write_back(dmc, frames[i].index, 1)) {
+			spin_unlock(&set->set_spin_lock);
+			continue;
+		}
+		spin_unlock(&set->set_spin_lock);
+		n++;
+
+		if (is_state(state, PARTIAL)) { /* Only its dirty sub-blocks */
+			wb_copy(dmc, frames[i].index);
+			continue;
+		}
+
+		/* Close the run unless this frame extends it */
+		if (j && (frames[i].block != frames[j-1].block + dmc->block_size ||
+		          (j + 1) * per > WB_RUN_PAGES)) {
+			wb_issue(dmc, frames, j);
+			j = 0;
+		}
+		frames[j++] = frames[i];
+	}
+	if (j)
+		wb_issue(dmc, frames, j);
+
+	return n;
+}
+
+
+
+/****************************************************************************
+ *  Functions for implementing the various cache operations.
+ ****************************************************************************/
+
+/*
+ * Map a block from the source device to a block in the cache device.
+ */
+static unsigned long hash_block(struct cache_c *dmc, sector_t block)
+{
+	unsigned long set_number, value;
+
+	value = (unsigned long)(block >> (dmc->block_shift +
+	        dmc->consecutive_shift));
+	set_number = hash_long(value, dmc->bits) / dmc->assoc;
+
+ 	return set_number;
+}
+
+/*
+ * Fold a block number into the 16-bit fingerprint kept next to its tag.
+ * Blocks sharing a set differ in their low bits, so a plain xor-fold keeps
+ * false matches rare without the cost of a multiplicative hash.
+ */
+static inline u16 fprint_block(struct cache_c *dmc, sector_t block)
+{
+	u64 value = (u64)block >> dmc->block_shift;
+
+	return (u16)(value ^ (value >> 16) ^ (value >> 32) ^ (value >> 48));
+}
+
+/*
+ * The count of frames of a set whose blocks fall in the same block of the
+ * largest class as block, or in another one sharing its slot. Only classes
+ * with smaller blocks keep counts; see class_owner().
+ */
+static inline unsigned int *owned_slot(struct cache_c *dmc,
+	                                   unsigned long set_number, sector_t block)
+{
+	unsigned long slot = dmc->assoc > 1 ? hash_long((unsigned long)
+	        (block >> dmc->region_shift), dmc->bits) & (dmc->assoc - 1) : 0;
+
+	return &dmc->owned[set_number * dmc->assoc + slot];
+}
+
+/*
+ * A frame is counted for the block it was last given, until it is given
+ * another, so counts may only be too high. Tags start out as NO_TAG.
+ */
+static inline void set_tag(struct cache_c *dmc, sector_t index, sector_t block)
+{
+	unsigned long set_number = (unsigned long)index / dmc->assoc;
+
+	if (dmc->owned) {
+		if (dmc->tags[index] != NO_TAG)
+			(*owned_slot(dmc, set_number, dmc->tags[index]))--;
+		(*owned_slot(dmc, set_number, block))++;
+	}
+	dmc->tags[index] = block;
+	dmc->fprints[index] = fprint_block(dmc, block);
+}
+
+/*
+ * Allocate the packed per-frame arrays (tags, fingerprints, states, prefetch
+ * tags and, if frames can be PARTIAL, sub-block masks) and the per-set
+ * metadata. The sets belong to the first class; the other classes of the
+ * cache have as many sets and share them.
+ */
+static int alloc_cache_frames(struct cache_c *dmc)
+{
+	sector_t nr_sets = (unsigned long)dmc->size / dmc->assoc, i;
+	int own_sets = dmc->top == dmc;
+
+	dmc->tags = vmalloc(dmc->size * sizeof(sector_t));
+	dmc->fprints = vmalloc(dmc->size * sizeof(u16));
+	dmc->states = vmalloc(dmc->size * sizeof(u8));
+	dmc->pf_tags = vzalloc(dmc->size * sizeof(u16));
+	dmc->sub_valid = dmc->sub_dirty = dmc->owned = NULL;
+	if (dmc->block_shift < dmc->region_shift)
+		dmc->owned = vzalloc(dmc->size * sizeof(unsigned int));
+	if (has_subs(dmc)) {
+		dmc->sub_valid = vmalloc(dmc->size * sizeof(u32));
+		dmc->sub_dirty = vmalloc(dmc->size * sizeof(u32));
+	}
+	if (own_sets)
+		dmc->cache_sets = vmalloc(nr_sets * sizeof(struct cache_set));
+	else
+		dmc->cache_sets = dmc->top->cache_sets;
+	if (!dmc->tags || !dmc->fprints || !dmc->states || !dmc->pf_tags ||
+	    (has_subs(dmc) && (!dmc->sub_valid || !dmc->sub_dirty)) ||
+	    (dmc->block_shift < dmc->region_shift && !dmc->owned) ||
+	    !dmc->cache_sets) {
+		vfree(dmc->tags);
+		vfree(dmc->fprints);
+		vfree(dmc->states);
+		vfree(dmc->pf_tags);
+		vfree(dmc->sub_valid);
+		vfree(dmc->sub_dirty);
+		vfree(dmc->owned);
+		if (own_sets)
+			vfree(dmc->cache_sets);
+		return -ENOMEM;
+	}
+	memset(dmc->tags, 0xff, dmc->size * sizeof(sector_t)); /* NO_TAG */
+
+	for (i=0; own_sets && i<nr_sets; i++) {
+		spin_lock_init(&dmc->cache_sets[i].set_spin_lock);
+		seqcount_init(&dmc->cache_sets[i].seq);
+		INIT_HLIST_HEAD(&dmc->cache_sets[i].pending);
+	}
+
+	return 0;
+}
+
+static void free_cache_frames(struct cache_c *dmc)
+{
+	vfree((void *)dmc->tags);
+	vfree((void *)dmc->fprints);
+	vfree((void *)dmc->states);
+	vfree((void *)dmc->pf_tags);
+	vfree((void *)dmc->sub_valid);
+	vfree((void *)dmc->sub_dirty);
+	vfree((void *)dmc->owned);
+	if (dmc->top == dmc)
+		vfree((void *)dmc->cache_sets);
+}
+
+static inline unsigned long cache_frames_mem(struct cache_c *dmc)
+{
+	return sizeof(sector_t) + 2 * sizeof(u16) + sizeof(u8) +
+	       (has_subs(dmc) ? 2 * sizeof(u32) : 0) +
+	       (dmc->block_shift < dmc->region_shift ? sizeof(unsigned int) : 0) +
+	       sizeof(struct cache_set) / dmc->assoc;
+}
+
+/****************************************************************************
+ *  Replacement policies.
+ *  A policy decides which frame of a full set is replaced on a miss; see
+ *  struct cache_policy for the hooks.
+ ****************************************************************************/
+
+static inline int evictable(u8 state)
+{
+	/* Blocks in the middle of copying are never chosen */
+	return !is_state(state, RESERVED) && !is_state(state, WRITEBACK);
+}
+
+/*
+ * CLOCK: a reference byte per frame and a hand per set.
+ * The flag lives in its own byte so that a hit is a plain store that cannot
+ * race with state updates of the frame, which lets READ hits skip the set
+ * lock. The store is skipped when the flag is already set to keep the line
+ * clean.
+ */
+struct clock_policy {
+	u8 *refs;		/* Reference flag of each frame */
+	unsigned int *hands;	/* Hand of each set */
+};
+
+static int clock_init(struct cache_c *dmc)
+{
+	struct clock_policy *clock;
+	sector_t nr_sets = (unsigned long)dmc->size / dmc->assoc;
+
+	clock = kzalloc(sizeof(*clock), GFP_KERNEL);
+	if (!clock)
+		return -ENOMEM;
+	clock->refs = vzalloc(dmc->size * sizeof(u8));
+	clock->hands = vzalloc(nr_sets * sizeof(unsigned int));
+	if (!clock->refs || !clock->hands) {
+		vfree(clock->refs);
+		vfree(clock->hands);
+		kfree(clock);
+		return -ENOMEM;
+	}
+
+	dmc->policy_ctx = clock;
+	return 0;
+}
+
+static void clock_exit(struct cache_c *dmc)
+{
+	struct clock_policy *clock = dmc->policy_ctx;
+
+	vfree(clock->refs);
+	vfree(clock->hands);
+	kfree(clock);
+}
+
+static void clock_hit(struct cache_c *dmc, sector_t index)
+{
+	struct clock_policy *clock = dmc->policy_ctx;
+
+	if (!clock->refs[index])
+		clock->refs[index] = 1;
+}
+
+/*
+ * A newly inserted block starts without its reference flag, so a block that
+ * is never touched again is the first to go when the hand comes around.
+ */
+static void clock_insert(struct cache_c *dmc, sector_t index, sector_t block,
+	                 unsigned int hint)
+{
+	struct clock_policy *clock = dmc->policy_ctx;
+
+	clock->refs[index] = 0;
+}
+
+/*
+ * The hand sweeps the set, giving referenced frames a second chance. A dirty
+ * frame is only returned after two full turns of the hand found no clean one.
+ */
+static int clock_victim(struct cache_c *dmc, unsigned long set_number,
+	                    sector_t block, sector_t *cache_block)
+{
+	struct clock_policy *clock = dmc->policy_ctx;
+	sector_t base = set_number * dmc->assoc, index;
+	unsigned int hand = clock->hands[set_number], mask = dmc->assoc - 1;
+	unsigned int n;
+	int dirty = -1, res = -1;
+	u8 state;
+
+	for (n=0; n<2*dmc->assoc; n++, hand = (hand + 1) & mask) {
+		index = base + hand;
+		state = dmc->states[index];
+		if (!evictable(state))
+			continue;
+		if (clock->refs[index]) { /* Second chance */
+			clock->refs[index] = 0;
+			continue;
+		}
+		if (!is_state(state, DIRTY)) {
+			*cache_block = index;
+			res = 0;
+			break;
+		}
+		if (-1 == dirty) dirty = hand;
+	}
+
+	if (-1 == res && -1 != dirty) {
+		*cache_block = base + dirty;
+		res = 2;
+	}
+	clock->hands[set_number] = (hand + 1) & mask;
+
+	return res;
+}
+
+static void clock_evict(struct cache_c *dmc, sector_t index)
+{
+}
+
+static struct cache_policy clock_policy = {
+	.name		= "clock",
+	.lockless_hit	= 1,
+	.init		= clock_init,
+	.exit		= clock_exit,
+	.hit		= clock_hit,
+	.insert		= clock_insert,
+	.victim		= clock_victim,
+	.evict		= clock_evict,
+};
+
+/*
+ * LRU, 2Q and ARC keep a 32-bit tick per frame, taken from a counter of its
+ * set, and the list each frame is on. Recency is the distance from the set's
+ * counter, so the counters may wrap freely and never need a reset; the LRU
+ * end of every list is found in one scan of the set on a miss. Ghost lists of
+ * evicted block numbers are fixed-size rings per set, searched through their
+ * fingerprints a word at a time like the frames of a set.
+ */
+#define Q_T1		0	/* ARC recency list; 2Q A1in; SARC RANDOM */
+#define Q_T2		1	/* ARC frequency list; 2Q Am; SARC SEQ */
+#define NR_QUEUES	2
+
+#define GHOST_EMPTY	((sector_t) -1)
+
+struct ghost_list {
+	sector_t *blocks;	/* Ring of evicted block numbers */
+	u16 *fprints;		/* Fingerprint of each slot, word aligned */
+	unsigned int size;	/* Capacity of the ring */
+	unsigned int head;	/* Next slot to fill */
+	unsigned int count;	/* Number of live entries */
+};
+
+struct stamp_set {
+	u32 tick;			/* Access counter of the set */
+	unsigned int target;		/* ARC target size of T1; SARC of SEQ */
+	unsigned int len[NR_QUEUES];	/* Frames on each list */
+	u32 bottom[NR_QUEUES];		/* SARC: last tick in each list's bottom */
+	struct ghost_list ghost[NR_QUEUES]; /* ARC B1/B2; 2Q A1out */
+};
+
+struct stamp_policy {
+	u32 *ticks;		/* Last access tick of each frame */
+	u8 *queues;		/* List of each frame */
+	struct stamp_set *sets;
+	sector_t *ghost_blocks;	/* Storage of all ghost rings */
+	u16 *ghost_fprints;	/* Their fingerprints */
+	atomic_t prefetch_depth; /* SARC prefetch depth in blocks */
+};
+
+/* Fingerprint slots of a ring, padded to whole words */
+#define GHOST_FPRINT_SLOTS(size)	roundup((size), FPRINT_LANES)
+
+static void ghost_push(struct cache_c *dmc, struct ghost_list *ghost,
+	                   sector_t block)
+{
+	if (!ghost->size)
+		return;
+	if (ghost->blocks[ghost->head] != GHOST_EMPTY)
+		ghost->count--;
+	ghost->blocks[ghost->head] = block;
+	ghost->fprints[ghost->head] = fprint_block(dmc, block);
+	ghost->count++;
+	if (++ghost->head == ghost->size)
+		ghost->head = 0;
+}
+
+/*
+ * Find a block on a ghost list. Fingerprints are compared a word at a time
+ * and only lanes that match have their block number loaded. Returns the slot,
+ * or -1.
+ */
+static int ghost_find(struct cache_c *dmc, struct ghost_list *ghost,
+	                  sector_t block)
+{
+	u16 fp = fprint_block(dmc, block);
+	unsigned long fpmask = REPEAT_U16(fp);
+	unsigned long *fpwords = (unsigned long *)ghost->fprints;
+	unsigned int i, j, words;
+
+	if (!ghost->count)
+		return -1;
+
+	words = GHOST_FPRINT_SLOTS(ghost->size) / FPRINT_LANES;
+	for (i=0; i<words; i++) {
+		if (!haszero_u16(fpwords[i] ^ fpmask))
+			continue;
+		for (j=i*FPRINT_LANES; j<(i+1)*FPRINT_LANES; j++) {
+			if (ghost->fprints[j] == fp && j < ghost->size &&
+			    ghost->blocks[j] == block)
+				return j;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Remove a block from a ghost list; returns 1 if it was there.
+ */
+static int ghost_take(struct cache_c *dmc, struct ghost_list *ghost,
+	                  sector_t block)
+{
+	int i = ghost_find(dmc, ghost, block);
+
+	if (-1 == i)
+		return 0;
+	ghost->blocks[i] = GHOST_EMPTY;
+	ghost->count--;
+	return 1;
+}
+
+static inline int ghost_has(struct cache_c *dmc, struct ghost_list *ghost,
+	                        sector_t block)
+{
+	return -1 != ghost_find(dmc, ghost, block);
+}
+
+/*
+ * Allocate the per-frame ticks and lists, and ghost rings of the given sizes
+ * for every set.
+ */
+static int stamp_init(struct cache_c *dmc, unsigned int ghost_size[NR_QUEUES])
+{
+	struct stamp_policy *sp;
+	sector_t nr_sets = (unsigned long)dmc->size / dmc->assoc, i, index;
+	unsigned int q, per_set = ghost_size[Q_T1] + ghost_size[Q_T2];
+	unsigned int fp_per_set = GHOST_FPRINT_SLOTS(ghost_size[Q_T1]) +
+	                          GHOST_FPRINT_SLOTS(ghost_size[Q_T2]);
+	sector_t *blocks;
+	u16 *fprints;
+
+	sp = kzalloc(sizeof(*sp), GFP_KERNEL);
+	if (!sp)
+		return -ENOMEM;
+	sp->ticks = vzalloc(dmc->size * sizeof(u32));
+	sp->queues = vzalloc(dmc->size * sizeof(u8));
+	sp->sets = vzalloc(nr_sets * sizeof(struct stamp_set));
+	if (per_set) {
+		sp->ghost_blocks = vmalloc(nr_sets * per_set * sizeof(sector_t));
+		sp->ghost_fprints = vzalloc(nr_sets * fp_per_set * sizeof(u16));
+	}
+	if (!sp->ticks || !sp->queues || !sp->sets ||
+	    (per_set && (!sp->ghost_blocks || !sp->ghost_fprints))) {
+		vfree(sp->ticks);
+		vfree(sp->queues);
+		vfree(sp->sets);
+		vfree(sp->ghost_blocks);
+		vfree(sp->ghost_fprints);
+		kfree(sp);
+		return -ENOMEM;
+	}
+
+	blocks = sp->ghost_blocks;
+	fprints = sp->ghost_fprints;
+	for (i=0; i<nr_sets; i++) {
+		for (q=0; q<NR_QUEUES; q++) {
+			sp->sets[i].ghost[q].blocks = blocks;
+			sp->sets[i].ghost[q].fprints = fprints;
+			sp->sets[i].ghost[q].size = ghost_size[q];
+			blocks += ghost_size[q];
+			fprints += GHOST_FPRINT_SLOTS(ghost_size[q]);
+		}
+	}
+	for (i=0; i<nr_sets * per_set; i++)
+		sp->ghost_blocks[i] = GHOST_EMPTY;
+
+	/* Blocks loaded from disk start on the first list */
+	for (index=0; index<dmc->size; index++)
+		if (is_state(dmc->states[index], VALID))
+			sp->sets[(unsigned long)index / dmc->assoc].len[Q_T1]++;
+
+	dmc->policy_ctx = sp;
+	return 0;
+}
+
+static void stamp_exit(struct cache_c *dmc)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+
+	vfree(sp->ticks);
+	vfree(sp->queues);
+	vfree(sp->sets);
+	vfree(sp->ghost_blocks);
+	vfree(sp->ghost_fprints);
+	kfree(sp);
+}
+
+static inline struct stamp_set *stamp_set(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+
+	return &sp->sets[(unsigned long)index / dmc->assoc];
+}
+
+static inline void stamp_touch(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+
+	sp->ticks[index] = ++stamp_set(dmc, index)->tick;
+}
+
+/*
+ * Take the LRU frame of the preferred list, falling back to the other list,
+ * and to dirty frames only when no clean frame is left in the set. A single
+ * scan of the set finds the oldest frame of every list, clean and dirty.
+ */
+static int stamp_victim(struct cache_c *dmc, unsigned long set_number,
+	                    int queue, sector_t *cache_block)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	sector_t base = set_number * dmc->assoc, index;
+	u32 tick = sp->sets[set_number].tick, age;
+	u32 oldest_age[2][NR_QUEUES];		/* [dirty][queue] */
+	int oldest[2][NR_QUEUES] = { { -1, -1 }, { -1, -1 } };
+	int i, dirty, q;
+	u8 state;
+
+	for (i=0, index=base; i<dmc->assoc; i++, index++) {
+		state = dmc->states[index];
+		if (!evictable(state) || !is_state(state, VALID))
+			continue;
+		dirty = is_state(state, DIRTY) ? 1 : 0;
+		q = sp->queues[index];
+		age = tick - sp->ticks[index];
+		if (-1 == oldest[dirty][q] || age > oldest_age[dirty][q]) {
+			oldest_age[dirty][q] = age;
+			oldest[dirty][q] = i;
+		}
+	}
+
+	for (dirty=0; dirty<2; dirty++) {
+		i = oldest[dirty][queue];
+		if (-1 == i)
+			i = oldest[dirty][!queue];
+		if (-1 != i) {
+			*cache_block = base + i;
+			return dirty ? 2 : 0;
+		}
+	}
+
+	return -1;
+}
+
+static void stamp_evict(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+
+	stamp_set(dmc, index)->len[sp->queues[index]]--;
+}
+
+/*
+ * LRU: a single list, the least recently used clean block is replaced.
+ */
+static int lru_init(struct cache_c *dmc)
+{
+	unsigned int ghost_size[NR_QUEUES] = { 0, 0 };
+
+	return stamp_init(dmc, ghost_size);
+}
+
+static void lru_insert(struct cache_c *dmc, sector_t index, sector_t block,
+	               unsigned int hint)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+
+	sp->queues[index] = Q_T1;
+	stamp_set(dmc, index)->len[Q_T1]++;
+	stamp_touch(dmc, index);
+}
+
+static int lru_victim(struct cache_c *dmc, unsigned long set_number,
+	                  sector_t block, sector_t *cache_block)
+{
+	return stamp_victim(dmc, set_number, Q_T1, cache_block);
+}
+
+static struct cache_policy lru_policy = {
+	.name		= "lru",
+	.init		= lru_init,
+	.exit		= stamp_exit,
+	.hit		= stamp_touch,
+	.insert		= lru_insert,
+	.victim		= lru_victim,
+	.evict		= stamp_evict,
+};
+
+/*
+ * 2Q (Johnson and Shasha): new blocks enter the A1in FIFO; a block missed
+ * again while its number is still on the A1out ghost list goes to the Am LRU
+ * list. A1in is held to a quarter of the set and A1out remembers half a set.
+ */
+static int twoq_init(struct cache_c *dmc)
+{
+	unsigned int ghost_size[NR_QUEUES] = { max(dmc->assoc / 2, 1U), 0 };
+
+	return stamp_init(dmc, ghost_size);
+}
+
+static void twoq_hit(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+
+	if (sp->queues[index] == Q_T2) /* A1in is FIFO; only Am is LRU */
+		stamp_touch(dmc, index);
+}
+
+static void twoq_insert(struct cache_c *dmc, sector_t index, sector_t block,
+	                unsigned int hint)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	struct stamp_set *set = stamp_set(dmc, index);
+
+	if (ghost_take(dmc, &set->ghost[Q_T1], block))
+		sp->queues[index] = Q_T2;
+	else
+		sp->queues[index] = Q_T1;
+	set->len[sp->queues[index]]++;
+	stamp_touch(dmc, index);
+}
+
+static int twoq_victim(struct cache_c *dmc, unsigned long set_number,
+	                   sector_t block, sector_t *cache_block)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	unsigned int kin = max(dmc->assoc / 4, 1U);
+
+	return stamp_victim(dmc, set_number,
+	                    sp->sets[set_number].len[Q_T1] > kin ? Q_T1 : Q_T2,
+	                    cache_block);
+}
+
+static void twoq_evict(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+
+	if (sp->queues[index] == Q_T1)
+		ghost_push(dmc, &stamp_set(dmc, index)->ghost[Q_T1],
+		           dmc->tags[index]);
+	stamp_evict(dmc, index);
+}
+
+static struct cache_policy twoq_policy = {
+	.name		= "2q",
+	.init		= twoq_init,
+	.exit		= stamp_exit,
+	.hit		= twoq_hit,
+	.insert		= twoq_insert,
+	.victim		= twoq_victim,
+	.evict		= twoq_evict,
+};
+
+/*
+ * ARC (Megiddo and Modha), per set: T1 holds blocks seen once, T2 blocks seen
+ * at least twice, and B1/B2 remember blocks recently evicted from each. A
+ * miss that hits B1 grows the target size of T1, one that hits B2 shrinks
+ * it, and the victim comes from T1 whenever T1 is above its target.
+ */
+static int arc_init(struct cache_c *dmc)
+{
+	unsigned int ghost_size[NR_QUEUES] = { dmc->assoc, dmc->assoc };
+
+	return stamp_init(dmc, ghost_size);
+}
+
+static void arc_hit(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	struct stamp_set *set = stamp_set(dmc, index);
+
+	if (sp->queues[index] == Q_T1) { /* Seen twice: move to T2 */
+		set->len[Q_T1]--;
+		set->len[Q_T2]++;
+		sp->queues[index] = Q_T2;
+	}
+	stamp_touch(dmc, index);
+}
+
+static void arc_insert(struct cache_c *dmc, sector_t index, sector_t block,
+	               unsigned int hint)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	struct stamp_set *set = stamp_set(dmc, index);
+	struct ghost_list *b1 = &set->ghost[Q_T1], *b2 = &set->ghost[Q_T2];
+	unsigned int delta;
+
+	if (ghost_take(dmc, b1, block)) { /* Recency list was too small */
+		delta = max(b2->count / (b1->count + 1), 1U);
+		set->target = min(set->target + delta, dmc->assoc);
+		sp->queues[index] = Q_T2;
+	} else if (ghost_take(dmc, b2, block)) { /* Frequency list was too small */
+		delta = max(b1->count / (b2->count + 1), 1U);
+		set->target = set->target > delta ? set->target - delta : 0;
+		sp->queues[index] = Q_T2;
+	} else
+		sp->queues[index] = Q_T1;
+	set->len[sp->queues[index]]++;
+	stamp_touch(dmc, index);
+}
+
+static int arc_victim(struct cache_c *dmc, unsigned long set_number,
+	                  sector_t block, sector_t *cache_block)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	struct stamp_set *set = &sp->sets[set_number];
+	unsigned int t1 = set->len[Q_T1];
+	int queue = Q_T2;
+
+	if (t1 && (t1 > set->target ||
+	           (t1 == set->target &&
+	            ghost_has(dmc, &set->ghost[Q_T2], block))))
+		queue = Q_T1;
+
+	return stamp_victim(dmc, set_number, queue, cache_block);
+}
+
+static void arc_evict(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+
+	ghost_push(dmc, &stamp_set(dmc, index)->ghost[sp->queues[index]],
+	           dmc->tags[index]);
+	stamp_evict(dmc, index);
+}
+
+static struct cache_policy arc_policy = {
+	.name		= "arc",
+	.init		= arc_init,
+	.exit		= stamp_exit,
+	.hit		= arc_hit,
+	.insert		= arc_insert,
+	.victim		= arc_victim,
+	.evict		= arc_evict,
+};
+
+/*
+ * SARC (Gill and Modha): blocks of sequential streams and random blocks are
+ * kept on separate LRU lists, SEQ and RANDOM. The victim comes from SEQ while
+ * SEQ is above its desired size in the set. A hit near the bottom of a list
+ * means that list would gain from a little more room, so hits in the bottom
+ * SARC_BOTTOM of SEQ grow the desired size and hits there in RANDOM shrink
+ * it. Rather than ranking the frame among its list on every hit, each list
+ * keeps the tick that ends its bottom, set from the tick span of the list on
+ * every eviction, so a hit compares a single tick. Nothing a hit changes
+ * needs the set lock, so hits are taken on the lockless READ path too. The
+ * same feedback sets how far streams are prefetched ahead: prefetched
+ * blocks that are barely used in time call for deeper prefetching, random
+ * blocks that are barely kept call for shallower prefetching.
+ */
+#define SARC_RANDOM		Q_T1
+#define SARC_SEQ		Q_T2
+#define SARC_BOTTOM_SHIFT	4	/* Bottom 1/16 of a list */
+#define SARC_MIN_PREFETCH	2	/* Prefetch depth bounds in blocks */
+#define SARC_MAX_PREFETCH	64
+
+static int sarc_init(struct cache_c *dmc)
+{
+	unsigned int ghost_size[NR_QUEUES] = { 0, 0 };
+	struct stamp_policy *sp;
+	sector_t nr_sets = (unsigned long)dmc->size / dmc->assoc, i;
+	int r;
+
+	r = stamp_init(dmc, ghost_size);
+	if (r)
+		return r;
+
+	sp = dmc->policy_ctx;
+	for (i=0; i<nr_sets; i++)
+		sp->sets[i].target = dmc->assoc / 2;
+	atomic_set(&sp->prefetch_depth, SARC_MIN_PREFETCH);
+
+	return 0;
+}
+
+/*
+ * May race with other hits on the set and with the locked hooks: a lost tick
+ * or target update only blurs recency, and target is stored from a single
+ * read so it stays within [0, assoc].
+ */
+static void sarc_hit(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	struct stamp_set *set = stamp_set(dmc, index);
+	u8 queue = ACCESS_ONCE(sp->queues[index]);
+	unsigned int target = ACCESS_ONCE(set->target);
+	u32 tick;
+
+	if ((s32)(sp->ticks[index] - ACCESS_ONCE(set->bottom[queue])) <= 0) {
+		if (queue == SARC_SEQ) {
+			if (target < dmc->assoc)
+				ACCESS_ONCE(set->target) = target + 1;
+			if (atomic_read(&sp->prefetch_depth) < SARC_MAX_PREFETCH)
+				atomic_inc(&sp->prefetch_depth);
+		} else {
+			if (target > 0)
+				ACCESS_ONCE(set->target) = target - 1;
+			if (atomic_read(&sp->prefetch_depth) > SARC_MIN_PREFETCH)
+				atomic_dec(&sp->prefetch_depth);
+		}
+	}
+	tick = ACCESS_ONCE(set->tick) + 1;
+	ACCESS_ONCE(set->tick) = tick;
+	sp->ticks[index] = tick;
+}
+
+static void sarc_insert(struct cache_c *dmc, sector_t index, sector_t block,
+	                    unsigned int hint)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	struct stamp_set *set = stamp_set(dmc, index);
+	u8 queue = (hint & POLICY_SEQ) ? SARC_SEQ : SARC_RANDOM;
+
+	sp->queues[index] = queue;
+	stamp_touch(dmc, index);
+	if (!set->len[queue]++) /* Alone on the list, so at its bottom */
+		set->bottom[queue] = sp->ticks[index];
+}
+
+/*
+ * The bottom of a list ends SARC_BOTTOM of its frames above the evicted one.
+ * Ticks of the list are taken to be spread evenly up to the set's counter.
+ */
+static void sarc_evict(struct cache_c *dmc, sector_t index)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	struct stamp_set *set = stamp_set(dmc, index);
+	u8 queue = sp->queues[index];
+	unsigned int len = set->len[queue];
+	unsigned int bottom = max(len >> SARC_BOTTOM_SHIFT, 1U);
+	u32 span = set->tick - sp->ticks[index];
+
+	set->bottom[queue] = sp->ticks[index] +
+	                     (u32)div_u64((u64)span * bottom, len);
+	stamp_evict(dmc, index);
+}
+
+static int sarc_victim(struct cache_c *dmc, unsigned long set_number,
+	                   sector_t block, sector_t *cache_block)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	struct stamp_set *set = &sp->sets[set_number];
+
+	return stamp_victim(dmc, set_number,
+	                    set->len[SARC_SEQ] > set->target ? SARC_SEQ : SARC_RANDOM,
+	                    cache_block);
+}
+
+/*
+ * Prefetching never goes beyond the room SEQ is meant to have in the set, or
+ * a stream would evict its own blocks before they are read.
+ */
+static unsigned int sarc_prefetch(struct cache_c *dmc, sector_t block)
+{
+	struct stamp_policy *sp = dmc->policy_ctx;
+	unsigned int depth = clamp(atomic_read(&sp->prefetch_depth),
+	                           SARC_MIN_PREFETCH, SARC_MAX_PREFETCH);
+	unsigned int room = ACCESS_ONCE(sp->sets[hash_block(dmc, block)].target);
+
+	return min(depth, max(room, 1U));
+}
+
+static struct cache_policy sarc_policy = {
+	.name		= "sarc",
+	.lockless_hit	= 1,
+	.init		= sarc_init,
+	.exit		= stamp_exit,
+	.hit		= sarc_hit,
+	.insert		= sarc_insert,
+	.victim		= sarc_victim,
+	.evict		= sarc_evict,
+	.prefetch	= sarc_prefetch,
+};
+
+static struct cache_policy *cache_policies[] = {
+	&clock_policy,
+	&lru_policy,
+	&twoq_policy,
+	&arc_policy,
+	&sarc_policy,
+};
+
+static struct cache_policy *find_policy(const char *name)
+{
+	int i;
+
+	for (i=0; i<ARRAY_SIZE(cache_policies); i++)
+		if (!strcmp(cache_policies[i]->name, name))
+			return cache_policies[i];
+
+	return NULL;
+}
+
+/****************************************************************************
+ *  TinyLFU admission filter.
+ *  Every block accessed is counted in a count-min sketch of four rows of
+ *  saturating 4-bit counters, kept one per byte. A doorkeeper bloom filter in
+ *  front of the sketch absorbs the first access of a block, so blocks seen
+ *  once never reach the counters. After ADMIT_SAMPLE accesses per counter of
+ *  a row, all counters are halved and the doorkeeper is cleared, so that old
+ *  popularity fades. A read miss that would replace a block is only admitted
+ *  if the missed block is estimated to be more popular than the victim.
+ *  Counters are updated without locks; a lost update only makes an estimate
+ *  a little low, which a sketch tolerates anyway.
+ ****************************************************************************/
+
+#define ADMIT_ROWS	4	/* Rows of the sketch */
+#define ADMIT_MAX	15	/* Counter saturation */
+#define ADMIT_SAMPLE	10	/* Accesses per counter before aging */
+#define ADMIT_DOOR_BITS	8	/* Doorkeeper bits per counter */
+
+struct admit_filter {
+	u8 *sketch;		/* ADMIT_ROWS rows of counters */
+	unsigned long *door;	/* Doorkeeper bloom filter */
+	unsigned long width;	/* Counters per row (power of 2) */
+	atomic_t accesses;	/* Accesses since the last aging */
+	spinlock_t age_lock;	/* Lock to serialize aging */
+};
+
+static int admit_init(struct cache_c *dmc)
+{
+	struct admit_filter *af;
+
+	af = kzalloc(sizeof(*af), GFP_KERNEL);
+	if (!af)
+		return -ENOMEM;
+	af->width = roundup_pow_of_two(dmc->size);
+	af->sketch = vzalloc(ADMIT_ROWS * af->width);
+	af->door = vzalloc(BITS_TO_LONGS(ADMIT_DOOR_BITS * af->width) *
+	                   sizeof(unsigned long));
+	if (!af->sketch || !af->door) {
+		vfree(af->sketch);
+		vfree(af->door);
+		kfree(af);
+		return -ENOMEM;
+	}
+	atomic_set(&af->accesses, 0);
+	spin_lock_init(&af->age_lock);
+
+	DMINFO("Admission filter: %luKB", (ADMIT_ROWS * af->width +
+	       ADMIT_DOOR_BITS * af->width / 8) >> 10);
+	dmc->admit = af;
+	return 0;
+}
+
+static void admit_exit(struct cache_c *dmc)
+{
+	struct admit_filter *af = dmc->admit;
+
+	if (!af)
+		return;
+	vfree(af->sketch);
+	vfree(af->door);
+	kfree(af);
+}
+
+/*
+ * Two independent hashes of the block number; the probes of the sketch rows
+ * and of the doorkeeper are derived from them by double hashing.
+ */
+static inline void admit_hash(struct cache_c *dmc, sector_t block,
+	                          u32 *h1, u32 *h2)
+{
+	u64 b = block >> dmc->block_shift;
+
+	*h1 = hash_64(b, 32);
+	*h2 = hash_64(b ^ 0x9e3779b97f4a7c15ULL, 32) | 1;
+}
+
+static inline unsigned long door_bit(struct admit_filter *af, u32 h1, u32 h2,
+	                                 int i)
+{
+	return (h1 + (i + ADMIT_ROWS) * h2) & (ADMIT_DOOR_BITS * af->width - 1);
+}
+
+static inline u8 *sketch_counter(struct admit_filter *af, u32 h1, u32 h2,
+	                             int i)
+{
+	return &af->sketch[i * af->width + ((h1 + i * h2) & (af->width - 1))];
+}
+
+/*
+ * Halve every counter and clear the doorkeeper. Counters are halved a word at
+ * a time; the mask drops the bit each byte would take from its neighbour.
+ */
+static void admit_age(struct admit_filter *af)
+{
+	unsigned long *words = (unsigned long *)af->sketch;
+	unsigned long i, n = dm_div_up(ADMIT_ROWS * af->width,
+	                               sizeof(unsigned long));
+
+	for (i=0; i<n; i++)
+		words[i] = (words[i] >> 1) & REPEAT_U8(0x7f);
+	memset(af->door, 0, BITS_TO_LONGS(ADMIT_DOOR_BITS * af->width) *
+	       sizeof(unsigned long));
+}
+
+/*
+ * Count an access to a block. The counters of the block are only raised if
+ * the doorkeeper has seen it before, and then only the smallest of them
+ * (conservative update).
+ */
+static void admit_record(struct cache_c *dmc, sector_t block)
+{
+	struct admit_filter *af = dmc->admit;
+	u8 *counter[ADMIT_ROWS], low = ADMIT_MAX;
+	u32 h1, h2;
+	int i, seen = 1;
+
+	admit_hash(dmc, block, &h1, &h2);
+	for (i=0; i<2; i++)
+		if (!test_and_set_bit(door_bit(af, h1, h2, i), af->door))
+			seen = 0;
+
+	if (seen) {
+		for (i=0; i<ADMIT_ROWS; i++) {
+			counter[i] = sketch_counter(af, h1, h2, i);
+			low = min(low, *counter[i]);
+		}
+		if (low < ADMIT_MAX)
+			for (i=0; i<ADMIT_ROWS; i++)
+				if (*counter[i] == low)
+					*counter[i] = low + 1;
+	}
+
+	if (atomic_inc_return(&af->accesses) >= ADMIT_SAMPLE * af->width &&
+	    spin_trylock(&af->age_lock)) {
+		if (atomic_read(&af->accesses) >= ADMIT_SAMPLE * af->width) {
+			admit_age(af);
+			atomic_set(&af->accesses, 0);
+		}
+		spin_unlock(&af->age_lock);
+	}
+}
+
+static unsigned int admit_estimate(struct cache_c *dmc, sector_t block)
+{
+	struct admit_filter *af = dmc->admit;
+	unsigned int est = ADMIT_MAX, i;
+	u32 h1, h2;
+
+	admit_hash(dmc, block, &h1, &h2);
+	for (i=0; i<2; i++)
+		if (!test_bit(door_bit(af, h1, h2, i), af->door))
+			return 0;
+	for (i=0; i<ADMIT_ROWS; i++)
+		est = min(est, (unsigned int)*sketch_counter(af, h1, h2, i));
+
+	return est + 1; /* Count the access the doorkeeper absorbed */
+}
+
+/*
+ * Whether a missed block should replace the block in the victim frame.
+ */
+static inline int admit_block(struct cache_c *dmc, sector_t block,
+	                          sector_t victim)
+{
+	return admit_estimate(dmc, block) > admit_estimate(dmc, victim);
+}
+
+/****************************************************************************
+ *  Prefetch accuracy.
+ *  A prefetched frame carries a tag naming the stream slot that prefetched it
+ *  and the slot's generation, so that feedback for a stream that has since
+ *  been replaced is dropped, and whether the stream was strided rather than
+ *  forward sequential. The tag is cleared on the first hit (the prefetch was
+ *  used) or when the frame is evicted (it was wasted).
+ ****************************************************************************/
+
+#define PF_SLOT_BITS	11	/* Slot + 1 of the stream; 0 means no tag */
+#define PF_SLOT_MASK	((1 << PF_SLOT_BITS) - 1)
+#define PF_GEN_MASK	((1 << (15 - PF_SLOT_BITS)) - 1)
+#define PF_STRIDED	(1 << 15)	/* Prefetched by a strided stream */
+#define PF_CORR		PF_SLOT_MASK	/* Prefetched by the successor table */
+#define PF_SAMPLE	64	/* Outcomes kept per stream before decaying */
+#define PF_MIN_SAMPLE	8	/* Outcomes needed to judge a stream */
+#define PF_GOOD_PCT	75	/* Accuracy to keep ramping up */
+#define PF_POOR_PCT	50	/* Accuracy below which windows shrink */
+
+static inline u16 pf_tag(struct cache_c *dmc, struct seq_stream *stream)
+{
+	return (stream->stride != 1 ? PF_STRIDED : 0) |
+	       ((stream->gen & PF_GEN_MASK) << PF_SLOT_BITS) |
+	       (stream - dmc->seq_streams + 1);
+}
+
+/*
+ * Credit the outcome of a prefetched block to its stream, if the stream is
+ * still tracked. Older outcomes are decayed so that a stream's accuracy
+ * follows its recent behaviour.
+ */
+static void prefetch_feedback(struct cache_c *dmc, u16 tag, int used)
+{
+	unsigned int slot = (tag & PF_SLOT_MASK) - 1;
+	struct seq_stream *stream;
+
+	if (used) {
+		cache_stat_inc(dmc, prefetch_hits);
+		if (tag & PF_STRIDED)
+			cache_stat_inc(dmc, stride_hits);
+		else if ((tag & PF_SLOT_MASK) == PF_CORR)
+			cache_stat_inc(dmc, corr_hits);
+	} else
+		cache_stat_inc(dmc, prefetch_unused);
+
+	spin_lock(&dmc->seq_lock);
+	if (slot < dmc->nr_seq_streams) {
+		stream = &dmc->seq_streams[slot];
+		if ((stream->gen & PF_GEN_MASK) ==
+		    ((tag >> PF_SLOT_BITS) & PF_GEN_MASK)) {
+			if (used)
+				stream->pf_used++;
+			else
+				stream->pf_wasted++;
+			if (stream->pf_used + stream->pf_wasted > PF_SAMPLE) {
+				stream->pf_used /= 2;
+				stream->pf_wasted /= 2;
+			}
+		}
+	}
+	spin_unlock(&dmc->seq_lock);
+}
+
+/*
+ * Drop the prefetch tag of a frame and return it. Tags only change under the
+ * set lock; the lockless READ hit path leaves tagged frames to the locked
+ * path.
+ */
+static inline u16 pf_clear(struct cache_c *dmc, sector_t index)
+{
+	u16 tag = dmc->pf_tags[index];
+
+	if (tag) {
+		dmc->pf_tags[index] = 0;
+		atomic_dec(&dmc->pf_frames);
+	}
+	return tag;
+}
+
+/*
+ * Prefetch partition.
+ * Unread prefetched frames may take at most pf_target frames of the cache.
+ * The target follows two ghost tables of block numbers: blocks whose prefetch
+ * was evicted unread, and demand blocks a prefetch evicted. A demand miss on
+ * the first means a larger partition would have hit, one on the second means
+ * a smaller one would have, and the target moves a step toward the winner, so
+ * frames shift between demand and prefetch data as the workload changes.
+ * The ghost tables are direct-mapped and updated without locks; a collision
+ * or race only forgets a ghost.
+ */
+#define PF_GHOST		0	/* Prefetches evicted unread */
+#define DEMAND_GHOST		1	/* Demand blocks evicted by prefetches */
+#define PF_GHOST_SHIFT		3	/* Ghost entries per frame, in bits */
+#define PF_TARGET_SHIFT		3	/* Initial target: 1/8 of the cache */
+#define PF_MIN_TARGET_SHIFT	6	/* Bounds: 1/64 .. 1/2 of the cache */
+#define PF_MAX_TARGET_SHIFT	1
+#define PF_STEP_SHIFT		10	/* Step: 1/1024 of the cache */
+
+static int pf_partition_init(struct cache_c *dmc)
+{
+	unsigned long entries = roundup_pow_of_two(max(dmc->size >>
+	                                           PF_GHOST_SHIFT, (sector_t)64));
+	unsigned long i;
+	int g;
+
+	dmc->pf_ghost_bits = ilog2(entries);
+	for (g=PF_GHOST; g<=DEMAND_GHOST; g++) {
+		dmc->pf_ghosts[g] = vmalloc(entries * sizeof(sector_t));
+		if (!dmc->pf_ghosts[g]) {
+			vfree(dmc->pf_ghosts[PF_GHOST]);
+			return -ENOMEM;
+		}
+		for (i=0; i<entries; i++)
+			dmc->pf_ghosts[g][i] = GHOST_EMPTY;
+	}
+
+	atomic_set(&dmc->pf_frames, 0);
+	atomic_set(&dmc->pf_target, dmc->size >> PF_TARGET_SHIFT);
+	return 0;
+}
+
+static void pf_partition_exit(struct cache_c *dmc)
+{
+	vfree(dmc->pf_ghosts[PF_GHOST]);
+	vfree(dmc->pf_ghosts[DEMAND_GHOST]);
+}
+
+static inline sector_t *pf_ghost_slot(struct cache_c *dmc, int ghost,
+	                                  sector_t block)
+{
+	return &dmc->pf_ghosts[ghost][hash_64(block >> dmc->block_shift,
+	                                      dmc->pf_ghost_bits)];
+}
+
+static inline void pf_ghost_add(struct cache_c *dmc, int ghost, sector_t block)
+{
+	*pf_ghost_slot(dmc, ghost, block) = block;
+}
+
+/*
+ * Adapt the partition on a demand READ miss.
+ */
+static void pf_partition_miss(struct cache_c *dmc, sector_t block)
+{
+	int step = max(dmc->size >> PF_STEP_SHIFT, (sector_t)1);
+	int target, bound;
+	sector_t *slot;
+
+	slot = pf_ghost_slot(dmc, PF_GHOST, block);
+	if (*slot == block) { /* Prefetched, but evicted before it was read */
+		*slot = GHOST_EMPTY;
+		bound = dmc->size >> PF_MAX_TARGET_SHIFT;
+		target = atomic_add_return(step, &dmc->pf_target);
+		if (target > bound)
+			atomic_set(&dmc->pf_target, bound);
+		return;
+	}
+
+	slot = pf_ghost_slot(dmc, DEMAND_GHOST, block);
+	if (*slot == block) { /* Pushed out by a prefetch */
+		*slot = GHOST_EMPTY;
+		bound = dmc->size >> PF_MIN_TARGET_SHIFT;
+		target = atomic_sub_return(step, &dmc->pf_target);
+		if (target < bound)
+			atomic_set(&dmc->pf_target, bound);
+	}
+}
+
+/*
+ * A block in the frame was accessed. Called with the set lock held.
+ */
+static inline void prefetch_touch(struct cache_c *dmc, sector_t index)
+{
+	u16 tag = pf_clear(dmc, index);
+
+	if (unlikely(tag))
+		prefetch_feedback(dmc, tag, 1);
+}
+
+/*
+ * The block in the frame leaves the cache. Called with the set lock held.
+ */
+static inline void prefetch_evict(struct cache_c *dmc, sector_t index)
+{
+	u16 tag = pf_clear(dmc, index);
+
+	if (unlikely(tag)) {
+		prefetch_feedback(dmc, tag, 0);
+		pf_ghost_add(dmc, PF_GHOST, dmc->tags[index]);
+	}
+}
+
+/*
+ * Find a block in a set.
+ *
+ * The set is scanned one machine word at a time: a word of state bytes tells
+ * whether a group holds any live frame or any empty one, and words of 16-bit
+ * fingerprints are compared against the block's fingerprint in parallel. Only
+ * lanes that pass both filters have their full tag loaded. If invalid is not
+ * NULL, the first empty frame is recorded in the same pass.
+ *
+ * Returns the way of the matching frame (VALID or RESERVED), or -1.
+ */
+static int cache_find(struct cache_c *dmc, sector_t base, sector_t block,
+	                  int *invalid)
+{
+	unsigned int cache_assoc = dmc->assoc;
+	u8 *states = dmc->states;
+	u16 fp = fprint_block(dmc, block);
+	unsigned long live, fpword, fpmask = REPEAT_U16(fp);
+	unsigned long *fpwords;
+	sector_t index;
+	int i, j;
+
+	if (cache_assoc < STATE_LANES) { /* Set too small to scan by words */
+		for (i=0, index=base; i<cache_assoc; i++, index++) {
+			if (!is_state(states[index], (VALID | RESERVED))) {
+				if (invalid && -1 == *invalid) *invalid = i;
+			} else if (dmc->tags[index] == block)
+				return i;
+		}
+		return -1;
+	}
+
+	for (i=0; i<cache_assoc; i+=STATE_LANES) {
+		index = base + i;
+		live = *(unsigned long *)&states[index] & REPEAT_U8(VALID | RESERVED);
+		if (!live) { /* The whole group is empty */
+			if (invalid && -1 == *invalid) *invalid = i;
+			continue;
+		}
+		if (invalid && -1 == *invalid && haszero_u8(live)) {
+			for (j=0; j<STATE_LANES; j++) { /* Some lane is empty */
+				if (!is_state(states[index + j], (VALID | RESERVED))) {
+					*invalid = i + j;
+					break;
+				}
+			}
+		}
+
+		fpwords = (unsigned long *)&dmc->fprints[index];
+		for (j=0; j<STATE_LANES/FPRINT_LANES; j++) {
+			fpword = fpwords[j] ^ fpmask;
+			if (!haszero_u16(fpword))
+				continue;
+			/* Some lane may match; confirm lane by lane */
+			for (index=base+i+j*FPRINT_LANES;
+			     index<base+i+(j+1)*FPRINT_LANES; index++) {
+				if (dmc->fprints[index] == fp &&
+				    is_state(states[index], (VALID | RESERVED)) &&
+				    dmc->tags[index] == block)
+					return index - base;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Block size classes.
+ * A cache may hold blocks of several sizes, e.g. small blocks for random I/O
+ * and large ones for sequential streams. Every class has its own frames,
+ * replacement policy, streams and stats, and a bio goes to the largest class
+ * whose blocks it fills. No source sector is held by two classes at once:
+ * every class hashes a block by the same region of sectors around it and has
+ * as many sets, so the frames of all classes that may hold a sector are in
+ * sets of the same number, which share one lock. The region is the one the
+ * first class would hash by on its own, or a block of the largest class if
+ * that is larger. Under that lock, a class that misses a block first checks
+ * that no other class holds any of its sectors, and if one does, the bio is
+ * mapped on that class instead. A larger class holds them in the one block
+ * that contains them; for a smaller class, each set counts its frames per
+ * block of the largest class, and only a nonzero count is looked into.
+ */
+
+/*
+ * The class other than dmc that holds some sector of a block of dmc, or NULL.
+ * Called with the set lock held.
+ */
+static struct cache_c *class_owner(struct cache_c *dmc,
+	                               unsigned long set_number, sector_t block)
+{
+	struct cache_c *top = dmc->top, *c;
+	sector_t base, sub, end = block + dmc->block_size;
+	unsigned int j;
+
+	for (j=0; j<top->nr_classes; j++) {
+		c = top->classes[j];
+		if (c == dmc)
+			continue;
+		base = set_number * c->assoc;
+		if (c->block_size >= dmc->block_size) { /* In one block of c */
+			if (cache_find(c, base, block - (block & c->block_mask),
+			               NULL) >= 0)
+				return c;
+			continue;
+		}
+		if (!*owned_slot(c, set_number, block))
+			continue; /* No frame of c in this region */
+		for (sub = block; sub < end; sub += c->block_size)
+			if (cache_find(c, base, sub, NULL) >= 0)
+				return c;
+	}
+
+	return NULL;
+}
+
+/* The class a bio is mapped on first: the largest one whose blocks it fills */
+static struct cache_c *bio_class(struct cache_c *dmc, struct bio *bio)
+{
+	unsigned int i = dmc->nr_classes - 1;
+
+	while (i && to_sector(bio->bi_size) < dmc->classes[i]->block_size)
+		i--;
+
+	return dmc->classes[i];
+}
+
+/*
+ * Lookup a block in the cache. Called with the set lock held.
+ * The first empty frame is recorded while searching; only a miss in a full
+ * set asks the replacement policy for a victim.
+ *
+ * Return value:
+ *  1: cache hit (cache_block stores the index of the matched block)
+ *  0: cache miss but frame is allocated for insertion; cache_block stores the
+ *     frame's index:
+ *      If there are empty frames, then the first encounted is used.
+ *      If there are clean frames, then the policy's clean victim is replaced.
+ *  2: cache miss and frame is not allocated; cache_block stores the policy's
+ *     dirty victim's index:
+ *      This happens when the entire set is dirty.
+ * -1: cache miss and no room for insertion:
+ *      This happens when the entire set in transition modes (RESERVED or
+ *      WRITEBACK).
+ *
+ */
+static int cache_lookup(struct cache_c *dmc, sector_t block,
+	                    sector_t *cache_block)
+{
+	unsigned long set_number = hash_block(dmc, block);
+	sector_t base = set_number * dmc->assoc;
+	int i, res = 0, invalid = -1;
+
+	i = cache_find(dmc, base, block, &invalid);
+	if (i >= 0) { /* Cache hit */
+		*cache_block = base + i;
+		dmc->policy->hit(dmc, *cache_block);
+		prefetch_touch(dmc, *cache_block);
+		res = 1;
+	} else if (invalid != -1) /* Cache miss; choose the first empty frame */
+		*cache_block = base + invalid;
+	else /* Cache miss in a full set; ask the policy for a victim */
+		res = dmc->policy->victim(dmc, set_number, block, cache_block);
+
+	if (-1 == res)
+		DPRINTK("Cache lookup: Block %llu(%lu):%s",
+	            block, set_number, "NO ROOM");
+	else
+		DPRINTK("Cache lookup: Block %llu(%lu):%llu(%s)",
+		        block, set_number, *cache_block,
+		        1 == res ? "HIT" : (0 == res ? "MISS" : "WB NEEDED"));
+	return res;
+}
+
+/*
+ * Serve a READ hit on a VALID block without taking the set lock.
+ * Writers bump the set's seqcount whenever a frame changes the block it holds
+ * or loses VALID, so a lookup that saw no change while it ran found a frame
+ * that still holds the block. Any other case (miss, block not yet VALID,
+ * concurrent change) returns 0 and the bio takes the locked path, as do the
+ * first hit on a prefetched block and all READ hits when the replacement
+ * policy needs the lock to record a hit.
+ */
+static int cache_read_hit_fast(struct cache_c *dmc, struct bio *bio,
+	                           sector_t block)
+{
+	unsigned long set_number = hash_block(dmc, block);
+	struct cache_set *set = &dmc->cache_sets[set_number];
+	sector_t base = set_number * dmc->assoc, cache_block;
+	unsigned int offset;
+	unsigned seq;
+	u8 state;
+	int i;
+
+	if (!dmc->policy->lockless_hit)
+		return 0;
+
+	seq = read_seqcount_begin(&set->seq);
+	i = cache_find(dmc, base, block, NULL);
+	if (i < 0)
+		return 0;
+	cache_block = base + i;
+	state = ACCESS_ONCE(dmc->states[cache_block]);
+	if (!is_state(state, VALID) || is_state(state, PARTIAL))
+		return 0;
+	if (ACCESS_ONCE(dmc->pf_tags[cache_block]))
+		return 0;
+	if (read_seqcount_retry(&set->seq, seq))
+		return 0;
+
+	dmc->policy->hit(dmc, cache_block);
+	cache_stat_inc(dmc, cache_hits);
+
+	offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
+	bio->bi_bdev = dmc->cache_dev->bdev;
+	bio->bi_sector = frame_sector(dmc, cache_block) + offset;
+
+	return 1;
+}
+
+/*
+ * Insert a block into the cache (in the frame specified by cache_block).
+ * Called with the set lock held; returns 0 if no pending entry is available.
+ */
+static int cache_insert(struct cache_c *dmc, sector_t block,
+	                    sector_t cache_block, unsigned int hint)
+{
+	/* Mark the block as RESERVED because although it is allocated, the data are
+       not in place until kcopyd finishes its job.
+	 */
+	if (pending_add(dmc, cache_block))
+		return 0;
+	if (is_state(dmc->states[cache_block], VALID)) { /* Replacing a block */
+		dmc->policy->evict(dmc, cache_block);
+		prefetch_evict(dmc, cache_block);
+	}
+	pf_clear(dmc, cache_block);
+	write_seqcount_begin(&frame_set(dmc, cache_block)->seq);
+	set_tag(dmc, cache_block, block);
+	dmc->states[cache_block] = RESERVED;
+	write_seqcount_end(&frame_set(dmc, cache_block)->seq);
+	dmc->policy->insert(dmc, cache_block, block, hint);
+
+	return 1;
+}
+
+/*
+ * Invalidate a block (specified by cache_block) in the cache.
+ * Called with the set lock held.
+ */
+static void cache_invalidate(struct cache_c *dmc, sector_t cache_block)
+{
+	DPRINTK("Cache invalidate: Block %llu(%llu)",
+	        cache_block, dmc->tags[cache_block]);
+	if (is_state(dmc->states[cache_block], VALID)) {
+		dmc->policy->evict(dmc, cache_block);
+		prefetch_evict(dmc, cache_block);
+	}
+	write_seqcount_begin(&frame_set(dmc, cache_block)->seq);
+	clear_state(dmc->states[cache_block], VALID);
+	write_seqcount_end(&frame_set(dmc, cache_block)->seq);
+}
+
+/*
+ * The sub-blocks of its frame that a bio touches, and those of them that it
+ * covers in full.
+ */
+static void bio_subs(struct cache_c *dmc, struct bio *bio, u32 *touched,
+	                 u32 *covered)
+{
+	unsigned int offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
+	unsigned int end = offset + to_sector(bio->bi_size);
+	unsigned int first = dm_div_up(offset, 1 << dmc->sub_shift);
+
+	*touched = sub_range(offset >> dmc->sub_shift,
+	                     dm_div_up(end, 1 << dmc->sub_shift));
+	*covered = first < (end >> dmc->sub_shift) ?
+	           sub_range(first, end >> dmc->sub_shift) : 0;
+}
+
+/*
+ * Handle a hit on a PARTIAL frame that lacks sub-blocks the bio needs. If the
+ * frame is in transition, the bio waits for the transition and is then mapped
+ * again. Otherwise the frame becomes RESERVED and the bio waits, remapped to
+ * the cache, for the missing sub-blocks to be fetched.
+ * Called with the set lock held; returns 2 if the caller has to start the
+ * fill once it has released the lock, or 0.
+ */
+static int cache_partial_hit(struct cache_c *dmc, struct bio *bio,
+	                         sector_t cache_block)
+{
+	unsigned int offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
+
+	if (is_state(dmc->states[cache_block], RESERVED) ||
+	    is_state(dmc->states[cache_block], WRITEBACK)) {
+		bio->bi_bdev = NULL;
+		pending_bio(dmc, cache_block, bio);
+		return 0;
+	}
+
+	if (pending_add(dmc, cache_block)) { /* Wait for an entry */
+		requeue_bio(dmc, bio);
+		return 0;
+	}
+	set_state(dmc->states[cache_block], RESERVED);
+	if (bio_data_dir(bio) == WRITE &&
+	    !is_state(dmc->states[cache_block], DIRTY)) {
+		set_state(dmc->states[cache_block], DIRTY);
+		dmc->sub_dirty[cache_block] = 0;
+		cache_stat_inc(dmc, dirty_blocks);
+	}
+
+	bio->bi_bdev = dmc->cache_dev->bdev;
+	bio->bi_sector = frame_sector(dmc, cache_block) + offset;
+	DPRINTK("Add to bio list %s(%llu)",
+			dmc->cache_dev->name, bio->bi_sector);
+	pending_bio(dmc, cache_block, bio);
+
+	return 2;
+}
+
+/*
+ * Handle a cache hit:
+ *  For READ, serve the request from cache is the block is ready; otherwise,
+ *  queue the request for later processing.
+ *  For write, invalidate the cache block if write-through. If write-back,
+ *  serve the request from cache if the block is ready, or queue the request
+ *  for later processing if otherwise.
+ *  A PARTIAL frame missing sub-blocks that the request needs is handled by
+ *  cache_partial_hit().
+ * Called with the set lock held.
+ */
+static int cache_hit(struct cache_c *dmc, struct bio* bio, sector_t cache_block)
+{
+	unsigned int offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
+	u8 state = dmc->states[cache_block];
+	u32 touched, covered, *valid;
+
+	if (is_state(state, PARTIAL)) {
+		valid = &dmc->sub_valid[cache_block];
+		bio_subs(dmc, bio, &touched, &covered);
+		if (bio_data_dir(bio) == READ) {
+			if (touched & ~*valid)
+				return cache_partial_hit(dmc, bio, cache_block);
+		} else if (dmc->write_policy == WRITE_BACK) {
+			/* Sub-blocks written in part must be cached already */
+			if (is_state(state, RESERVED) || is_state(state, WRITEBACK) ||
+			    (touched & ~covered & ~*valid))
+				return cache_partial_hit(dmc, bio, cache_block);
+			if (!is_state(state, DIRTY))
+				dmc->sub_dirty[cache_block] = 0;
+			*valid |= covered;
+			dmc->sub_dirty[cache_block] |= touched;
+			if (*valid == frame_subs(dmc))
+				clear_state(dmc->states[cache_block], PARTIAL);
+		}
+	}
+
+	if (bio_data_dir(bio) == READ) { /* READ hit */
+		bio->bi_bdev = dmc->cache_dev->bdev;
+		bio->bi_sector = frame_sector(dmc, cache_block) + offset;
+
+		if (is_state(dmc->states[cache_block], VALID)) /* Valid cache block */
+			return 1;
+
+		/* Cache block is not ready yet */
+		DPRINTK("Add to bio list %s(%llu)",
+				dmc->cache_dev->name, bio->bi_sector);
+		pending_bio(dmc, cache_block, bio);
+
+		return 0;
+	} else { /* WRITE hit */
+		if (dmc->write_policy == WRITE_THROUGH) { /* Invalidate cached data */
+			cache_invalidate(dmc, cache_block);
+			bio->bi_bdev = dmc->src_dev->bdev;
+			return 1;
+		}
+
+		/* Write delay */
+		if (!is_state(dmc->states[cache_block], DIRTY)) {
+			set_state(dmc->states[cache_block], DIRTY);
+			cache_stat_inc(dmc, dirty_blocks);
+		}
 
  		/* In the middle of write back */
-		if (is_state(cache[cache_block].state, WRITEBACK)) {
+		if (is_state(dmc->states[cache_block], WRITEBACK)) {
 			/* Delay this write until the block is written back */
 			bio->bi_bdev = dmc->src_dev->bdev;
 			DPRINTK("Add to bio list %s(%llu)",
 					dmc->src_dev->name, bio->bi_sector);
-			bio_list_add(&cache[cache_block].bios, bio);
-			spin_unlock(&cache[cache_block].lock);
+			pending_bio(dmc, cache_block, bio);
+			return 0;
+		}
+
+		/* Cache block not ready yet */
+		if (is_state(dmc->states[cache_block], RESERVED)) {
+			bio->bi_bdev = dmc->cache_dev->bdev;
+			bio->bi_sector = frame_sector(dmc, cache_block) + offset;
+			DPRINTK("Add to bio list %s(%llu)",
+					dmc->cache_dev->name, bio->bi_sector);
+			pending_bio(dmc, cache_block, bio);
 			return 0;
 		}
-
-		/* Cache block not ready yet */
-		if (is_state(cache[cache_block].state, RESERVED)) {
-			bio->bi_bdev = dmc->cache_dev->bdev;
-			bio->bi_sector = (cache_block << dmc->block_shift) + offset;
-			DPRINTK("Add to bio list %s(%llu)",
-					dmc->cache_dev->name, bio->bi_sector);
-			bio_list_add(&cache[cache_block].bios, bio);
-			spin_unlock(&cache[cache_block].lock);
-			return 0;
+
+		/* Serve the request from cache */
+		bio->bi_bdev = dmc->cache_dev->bdev;
+		bio->bi_sector = frame_sector(dmc, cache_block) + offset;
+
+		return 1;
+	}
+}
+
+/* Whether a job can hold the segments of a bio */
+static inline int job_fits(struct bio *bio)
+{
+	return bio->bi_vcnt - bio->bi_idx <= MAX_BLOCK_PAGES;
+}
+
+static struct kcached_job *new_kcached_job(struct cache_c *dmc, struct bio* bio,
+	                                       sector_t request_block,
+                                           sector_t cache_block)
+{
+	struct dm_io_region src, dest;
+	struct kcached_job *job;
+
+	src.bdev = dmc->src_dev->bdev;
+	src.sector = request_block;
+	src.count = dmc->block_size;
+	dest.bdev = dmc->cache_dev->bdev;
+	dest.sector = frame_sector(dmc, cache_block);
+	dest.count = src.count;
+
+	job = mempool_alloc(_job_pool, GFP_NOIO);
+	job->dmc = dmc;
+	job->bio = bio;
+	job->src = src;
+	job->dest = dest;
+	job->cache_block = cache_block;
+	job->nr_copies = 0;
+	job->error = 0;
+
+	return job;
+}
+
+/*
+ * Claim a frame for a missed block: update the metadata under the set lock
+ * and release the lock. If subs is not 0, only those sub-blocks are going to
+ * be stored. Returns 0 if the frame is now RESERVED for the block, or 1 if it
+ * could not be claimed and the bio should go to the source device.
+ */
+static int cache_claim(struct cache_c *dmc, struct cache_set *set,
+	                   sector_t request_block, sector_t cache_block,
+	                   int dirty, u32 subs, unsigned int hint)
+{
+	int replace = dmc->states[cache_block] & VALID;
+
+	if (!cache_insert(dmc, request_block, cache_block, hint)) {
+		spin_unlock(&set->set_spin_lock);
+		return 1;
+	}
+	if (dirty) /* Write delay */
+		set_state(dmc->states[cache_block], DIRTY);
+	if (subs) {
+		set_state(dmc->states[cache_block], PARTIAL);
+		dmc->sub_valid[cache_block] = dmc->sub_dirty[cache_block] = subs;
+	}
+	spin_unlock(&set->set_spin_lock);
+
+	if (replace) {
+		DPRINTK("Replacing block at frame %llu with %llu",
+		        cache_block, request_block);
+		cache_stat_inc(dmc, replace);
+	} else DPRINTK("Insert block %llu at empty frame %llu",
+		request_block, cache_block);
+	if (dirty)
+		cache_stat_inc(dmc, dirty_blocks);
+
+	return 0;
+}
+
+/*
+ * Handle a read cache miss:
+ *  Update the metadata; fetch the necessary block from source device;
+ *  store data to cache device.
+ * Called with the set lock held; the lock is released once the frame has been
+ * claimed, before any I/O is set up.
+ */
+static int cache_read_miss(struct cache_c *dmc, struct bio* bio,
+	                       struct cache_set *set, sector_t cache_block,
+	                       unsigned int hint) {
+	unsigned int offset, head, tail;
+	struct kcached_job *job;
+	sector_t request_block, left;
+
+	offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
+	request_block = bio->bi_sector - offset;
+
+	/* Keep the victim if the missed block is not more popular */
+	if (dmc->admit && is_state(dmc->states[cache_block], VALID) &&
+	    !admit_block(dmc, request_block, dmc->tags[cache_block])) {
+		spin_unlock(&set->set_spin_lock);
+		cache_stat_inc(dmc, rejected);
+		bio->bi_bdev = dmc->src_dev->bdev;
+		return 1;
+	}
+
+	if (!job_fits(bio)) { /* Too fragmented to cache; forward */
+		spin_unlock(&set->set_spin_lock);
+		bio->bi_bdev = dmc->src_dev->bdev;
+		return 1;
+	}
+
+	/* Update metadata first */
+	if (cache_claim(dmc, set, request_block, cache_block, 0, 0, hint)) {
+		bio->bi_bdev = dmc->src_dev->bdev;
+		return 1;
+	}
+
+	job = new_kcached_job(dmc, bio, request_block, cache_block);
+
+	head = to_bytes(offset);
+
+	left = (dmc->src_dev->bdev->bd_inode->i_size>>9) - request_block;
+	if (left < dmc->block_size) {
+		tail = to_bytes(left) - bio->bi_size - head;
+		job->src.count = left;
+		job->dest.count = left;
+	} else
+		tail = to_bytes(dmc->block_size) - bio->bi_size - head;
+
+	/* Requested block is aligned with a cache block */
+	if (0 == head && 0 == tail)
+		job->nr_pages= 0;
+	else /* Need new pages to store extra data */
+		job->nr_pages = dm_div_up(head, PAGE_SIZE) + dm_div_up(tail, PAGE_SIZE);
+	job->rw = READ; /* Fetch data from the source device */
+
+	DPRINTK("Queue job for %llu (need %u pages)",
+	        bio->bi_sector, job->nr_pages);
+	queue_job(job);
+
+	return 0;
+}
+
+/*
+ * Handle a write cache miss:
+ *  If write-through, forward the request to source device.
+ *  If write-back, update the metadata; fetch the necessary block from source
+ *  device; write to cache device.
+ * Called with the set lock held, which is released before returning.
+ */
+static int cache_write_miss(struct cache_c *dmc, struct bio* bio,
+	                        struct cache_set *set, sector_t cache_block,
+	                        unsigned int hint) {
+	unsigned int offset, head, tail;
+	struct kcached_job *job;
+	sector_t request_block, left;
+	u32 touched, covered, subs = 0;
+
+	if (dmc->write_policy == WRITE_THROUGH) { /* Forward request to souuce */
+		spin_unlock(&set->set_spin_lock);
+		bio->bi_bdev = dmc->src_dev->bdev;
+		return 1;
+	}
+
+	if (!job_fits(bio)) { /* Too fragmented to cache; forward */
+		spin_unlock(&set->set_spin_lock);
+		bio->bi_bdev = dmc->src_dev->bdev;
+		return 1;
+	}
+
+	offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
+	request_block = bio->bi_sector - offset;
+
+	head = to_bytes(offset);
+	left = (dmc->src_dev->bdev->bd_inode->i_size>>9) - request_block;
+	if (left < dmc->block_size)
+		tail = to_bytes(left) - bio->bi_size - head;
+	else
+		tail = to_bytes(dmc->block_size) - bio->bi_size - head;
+
+	/* A write of whole sub-blocks is stored without the rest of the block */
+	if (has_subs(dmc)) {
+		bio_subs(dmc, bio, &touched, &covered);
+		if ((head || tail) && touched == covered)
+			subs = covered;
+	}
+
+	/* Update metadata first */
+	if (cache_claim(dmc, set, request_block, cache_block, 1, subs, hint)) {
+		bio->bi_bdev = dmc->src_dev->bdev;
+		return 1;
+	}
+
+	job = new_kcached_job(dmc, bio, request_block, cache_block);
+	if (left < dmc->block_size) {
+		job->src.count = left;
+		job->dest.count = left;
+	}
+
+	if (0 == head && 0 == tail) { /* Requested is aligned with a cache block */
+		job->nr_pages = 0;
+		job->rw = WRITE;
+	} else if (subs) { /* Store the sub-blocks in place */
+		job->dest.sector += offset;
+		job->dest.count = to_sector(bio->bi_size);
+		job->nr_pages = 0;
+		job->rw = WRITE;
+		cache_stat_inc(dmc, partial_writes);
+	} else if (head && tail){ /* Special case: need to pad both head and tail */
+		job->nr_pages = dm_div_up(to_bytes(job->src.count), PAGE_SIZE);
+		job->rw = READ;
+	} else {
+		if (head) { /* Fetch only head */
+			job->src.count = to_sector(head);
+			job->nr_pages = dm_div_up(head, PAGE_SIZE);
+		} else { /* Fetch only tail */
+			job->src.sector = bio->bi_sector + to_sector(bio->bi_size);
+			job->src.count = to_sector(tail);
+			job->nr_pages = dm_div_up(tail, PAGE_SIZE);
+		}
+		job->rw = READ;
+	}
+
+	queue_job(job);
+
+	return 0;
+}
+
+/* Handle cache misses. Called with the set lock held, which is released. */
+static int cache_miss(struct cache_c *dmc, struct bio* bio,
+	                  struct cache_set *set, sector_t cache_block,
+	                  unsigned int hint) {
+	if (bio_data_dir(bio) == READ)
+		return cache_read_miss(dmc, bio, set, cache_block, hint);
+	else
+		return cache_write_miss(dmc, bio, set, cache_block, hint);
+}
+
+
+/****************************************************************************
+ *  Functions for detecting sequential streams and prefetching them.
+ ****************************************************************************/
+
+static struct seq_stream *seq_alloc(struct list_head *lru, unsigned int nr)
+{
+	struct seq_stream *streams;
+	unsigned int i;
+
+	streams = kcalloc(nr, sizeof(struct seq_stream), GFP_KERNEL);
+	if (!streams)
+		return NULL;
+
+	INIT_LIST_HEAD(lru);
+	for (i=0; i<nr; i++)
+		list_add(&streams[i].lru, lru);
+
+	return streams;
+}
+
+static int seq_init(struct cache_c *dmc)
+{
+	spin_lock_init(&dmc->seq_lock);
+	dmc->nr_seq_streams = DEFAULT_SEQ_STREAMS;
+	dmc->skip_seq_thresh_kb = DEFAULT_SKIP_SEQ_THRESH_KB;
+	dmc->readahead_kb = DEFAULT_READAHEAD_KB;
+	dmc->seq_streams = seq_alloc(&dmc->seq_lru, dmc->nr_seq_streams);
+	if (!dmc->seq_streams)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Change the number of streams tracked. The streams seen so far are
+ * forgotten.
+ */
+static int seq_resize(struct cache_c *dmc, unsigned int nr)
+{
+	struct seq_stream *streams, *old;
+	struct list_head lru;
+
+	if (nr < 1 || nr > MAX_SEQ_STREAMS)
+		return -EINVAL;
+	streams = seq_alloc(&lru, nr);
+	if (!streams)
+		return -ENOMEM;
+
+	spin_lock(&dmc->seq_lock);
+	old = dmc->seq_streams;
+	dmc->seq_streams = streams;
+	dmc->nr_seq_streams = nr;
+	INIT_LIST_HEAD(&dmc->seq_lru);
+	list_splice(&lru, &dmc->seq_lru);
+	spin_unlock(&dmc->seq_lock);
+
+	kfree(old);
+	return 0;
+}
+
+static void seq_exit(struct cache_c *dmc)
+{
+	kfree(dmc->seq_streams);
+}
+
+/*
+ * Match a bio against the recently seen streams. Returns 1 if the block
+ * continues a stream of at least SEQ_MIN_RUN blocks at a constant stride.
+ * *bypass is set once the stream is longer than skip_seq_thresh_kb (if set),
+ * in which case its misses are not cached.
+ */
+static int seq_classify(struct cache_c *dmc, struct bio *bio,
+	                    sector_t request_block, int *bypass)
+{
+	struct seq_stream *stream, *near = NULL;
+	s64 delta;
+	int found = 0, sequential;
+
+	spin_lock(&dmc->seq_lock);
+	list_for_each_entry(stream, &dmc->seq_lru, lru) {
+		if (request_block == stream->last) { /* Reread or rewrite */
+			found = 1;
+			break;
+		}
+		if (stream->stride && request_block == stream->last +
+		    (s64)stream->stride * dmc->block_size) {
+			stream->last = request_block;
+			stream->count++;
+			found = 1;
+			break;
 		}
+		delta = (s64)(request_block - stream->last) >> dmc->block_shift;
+		if (!near && stream->count < SEQ_MIN_RUN &&
+		    delta >= -SEQ_MAX_STRIDE && delta <= SEQ_MAX_STRIDE)
+			near = stream;
+	}
+	if (!found && near) { /* Retrain an unconfirmed stream */
+		stream = near;
+		stream->stride = (long)((s64)(request_block - stream->last) >>
+		                        dmc->block_shift);
+		stream->last = request_block;
+		stream->count = 2;
+		stream->ra_size = 0;
+	} else if (!found) { /* Start a new stream in place of the oldest */
+		stream = list_entry(dmc->seq_lru.prev, struct seq_stream, lru);
+		stream->last = request_block;
+		stream->stride = 0;
+		stream->count = 1;
+		stream->ra_size = 0;
+		stream->gen++;
+		stream->pf_used = stream->pf_wasted = 0;
+	}
+	list_move(&stream->lru, &dmc->seq_lru);
 
-		/* Serve the request from cache */
-		bio->bi_bdev = dmc->cache_dev->bdev;
-		bio->bi_sector = (cache_block << dmc->block_shift) + offset;
+	if (dmc->skip_seq_thresh_kb && (sector_t)stream->count *
+	    dmc->block_size > (sector_t)dmc->skip_seq_thresh_kb * 2) {
+		DPRINTK("Sequential stream at %llu (%lu blocks) bypasses the cache",
+		        request_block, stream->count);
+		*bypass = 1;
+	}
+	sequential = stream->count >= SEQ_MIN_RUN;
+	spin_unlock(&dmc->seq_lock);
+
+	return sequential;
+}
+
+/*
+ * Readahead window sizing, after the kernel's page cache readahead: the first
+ * window of a stream is small, and each window is two to four times the size
+ * of the one before, up to max blocks.
+ */
+static unsigned int ra_init_size(unsigned int size, unsigned int max)
+{
+	unsigned int newsize = roundup_pow_of_two(size);
+
+	if (newsize <= max / 32)
+		newsize = newsize * 4;
+	else if (newsize <= max / 4)
+		newsize = newsize * 2;
+	else
+		newsize = max;
+
+	return newsize;
+}
+
+static unsigned int ra_next_size(unsigned int cur, unsigned int max)
+{
+	unsigned int newsize;
+
+	if (cur < max / 16)
+		newsize = 4 * cur;
+	else
+		newsize = 2 * cur;
+
+	return min(newsize, max);
+}
+
+/*
+ * Prefetch accuracy of a stream: 1 if enough of its prefetched blocks are
+ * read to keep ramping up, -1 if so few are that its window should shrink,
+ * 0 in between. A stream with too few outcomes yet counts as accurate.
+ */
+static int ra_accuracy(struct seq_stream *stream)
+{
+	unsigned int used = stream->pf_used, total = used + stream->pf_wasted;
 
-		spin_unlock(&cache[cache_block].lock);
+	if (total < PF_MIN_SAMPLE || used * 100 >= total * PF_GOOD_PCT)
 		return 1;
+	if (used * 100 < total * PF_POOR_PCT)
+		return -1;
+	return 0;
+}
+
+/*
+ * The largest readahead window at a block in blocks: readahead_kb, further
+ * limited by the prefetch depth of a policy that sets one. 0 disables
+ * readahead.
+ */
+static unsigned int ra_max_size(struct cache_c *dmc, sector_t block)
+{
+	unsigned int max = (ACCESS_ONCE(dmc->readahead_kb) * 2) >> dmc->block_shift;
+
+	if (dmc->policy->prefetch)
+		max = max ? min(max, dmc->policy->prefetch(dmc, block)) :
+		      dmc->policy->prefetch(dmc, block);
+
+	return max;
+}
+
+/*
+ * Frames of the block's set a prefetch may take: empty frames and clean frames
+ * that are not in transition. Read without the set lock, as an estimate of
+ * the pressure on the set.
+ */
+static unsigned int set_room(struct cache_c *dmc, sector_t block)
+{
+	sector_t base = hash_block(dmc, block) * dmc->assoc, i;
+	unsigned int room = 0;
+	u8 state;
+
+	for (i=base; i<base+dmc->assoc; i++) {
+		state = ACCESS_ONCE(dmc->states[i]);
+		if (!is_state(state, (VALID | RESERVED)) ||
+		    (!is_state(state, DIRTY) && evictable(state)))
+			room++;
 	}
+
+	return room;
 }
 
-static struct kcached_job *new_kcached_job(struct cache_c *dmc, struct bio* bio,
-	                                       sector_t request_block,
-                                           sector_t cache_block)
+/*
+ * Move the readahead window of the stream that just read request_block, and
+ * return the blocks to prefetch: *ra_count blocks (0 if none) starting at
+ * *ra_block, *ra_step sectors apart in ascending order, whatever the
+ * direction of the stream.
+ *  - A stream without a window, or one that ran past it, starts a small
+ *    window one stride after the block.
+ *  - Reading the async marker issues the next window. It is larger than the
+ *    last while the stream's prefetches are accurate, the same size while
+ *    they are so-so, and half the size while most of them are wasted.
+ *  - A miss inside the window means its blocks were evicted before they were
+ *    read, or never fetched; the window is halved and restarted after the
+ *    block.
+ * A window never takes more than half of the room left in its set. *ra_tag
+ * is set to the tag for the prefetched frames.
+ */
+static void seq_readahead(struct cache_c *dmc, sector_t request_block,
+	                      int hit, sector_t *ra_block, unsigned int *ra_count,
+	                      unsigned long *ra_step, u16 *ra_tag)
+{
+	unsigned int max = ra_max_size(dmc, request_block), size, room;
+	struct seq_stream *stream;
+	s64 start = 0, pos, first, step;
+	long stride;
+	int found = 0, accuracy, in_window;
+
+	if (!max)
+		return;
+
+	spin_lock(&dmc->seq_lock);
+	list_for_each_entry(stream, &dmc->seq_lru, lru) {
+		if (stream->last == request_block) {
+			found = 1;
+			break;
+		}
+	}
+	if (!found || !stream->stride) { /* Stream taken over meanwhile */
+		spin_unlock(&dmc->seq_lock);
+		return;
+	}
+
+	size = 0;
+	stride = stream->stride;
+	step = (s64)stride * dmc->block_size;
+	accuracy = ra_accuracy(stream);
+	pos = div_s64(((s64)request_block - (s64)stream->ra_start) >>
+	              dmc->block_shift, stride);
+	in_window = stream->ra_size && pos >= 0 && pos < stream->ra_size &&
+	            (s64)stream->ra_start + pos * step == (s64)request_block;
+	if (!in_window) { /* Initial window */
+		start = (s64)request_block + step;
+		size = accuracy < 0 ? 1 : ra_init_size(1, max);
+	} else if (request_block == stream->ra_start && hit) { /* Async marker */
+		start = (s64)stream->ra_start + (s64)stream->ra_size * step;
+		if (accuracy > 0)
+			size = ra_next_size(stream->ra_size, max);
+		else if (accuracy == 0)
+			size = min(stream->ra_size, max);
+		else
+			size = max(min(stream->ra_size, max) / 2, 1U);
+	} else if (!hit) { /* Readahead thrashing */
+		start = (s64)request_block + step;
+		size = max(min(stream->ra_size, max) / 2, 1U);
+	}
+	if (size && start < 0) /* Backward scan reached the start */
+		size = 0;
+	if (size) {
+		stream->ra_start = start;
+		stream->ra_size = size;
+		*ra_tag = pf_tag(dmc, stream);
+		DPRINTK("Readahead window %lld (%u blocks, stride %ld) at %llu%s",
+		        start, size, stride, request_block, hit ? "" : " (miss)");
+	}
+	spin_unlock(&dmc->seq_lock);
+
+	if (!size)
+		return;
+	room = set_room(dmc, start) / 2;
+	size = min(size, room);
+	if (!size)
+		return;
+	first = start + (s64)(size - 1) * step;
+	if (first < 0) { /* Keep the blocks of a backward scan above 0 */
+		size = div_s64(start >> dmc->block_shift, -stride) + 1;
+		first = start + (s64)(size - 1) * step;
+	}
+	*ra_block = stride > 0 ? start : first;
+	*ra_count = size;
+	*ra_step = stride > 0 ? step : -step;
+}
+
+/*
+ * Copy a run of blocks from the source device into consecutive frames with a
+ * single kcopyd job. copy_callback() releases every frame of the run.
+ */
+static void prefetch_run(struct cache_c *dmc, sector_t block,
+	                     sector_t cache_block, unsigned int length)
 {
 	struct dm_io_region src, dest;
-	struct kcached_job *job;
 
+	DPRINTK("Prefetch blocks %llu-%llu into frames %llu-%llu",
+	        block, block + ((sector_t)(length - 1) << dmc->block_shift),
+	        cache_block, cache_block + length - 1);
 	src.bdev = dmc->src_dev->bdev;
-	src.sector = request_block;
-	src.count = dmc->block_size;
+	src.sector = block;
+	src.count = dmc->block_size * length;
 	dest.bdev = dmc->cache_dev->bdev;
-	dest.sector = cache_block << dmc->block_shift;
+	dest.sector = frame_sector(dmc, cache_block);
 	dest.count = src.count;
+	copy_block(dmc, src, dest, cache_block, 0);
+}
 
-	job = mempool_alloc(_job_pool, GFP_NOIO);
-	job->dmc = dmc;
-	job->bio = bio;
-	job->src = src;
-	job->dest = dest;
-	job->cacheblock = &dmc->cache[cache_block];
+/*
+ * Read count blocks, step sectors apart from block upward, into the cache
+ * ahead of a stream. A block only takes an empty or clean frame; blocks
+ * already cached, or whose set has nothing but dirty or busy frames, are
+ * skipped. Called without locks, as kcopyd may sleep.
+ * Frames are claimed for the whole window first, and blocks that are adjacent
+ * on the source device and land in adjacent frames are fetched as one run. To
+ * make runs long, a block takes the frame right after the previous block's
+ * if that frame is empty.
+ */
+static void prefetch_blocks(struct cache_c *dmc, sector_t block,
+	                        unsigned int count, unsigned long step, u16 tag)
+{
+	sector_t dev_size = dmc->src_dev->bdev->bd_inode->i_size >> 9;
+	sector_t base, cache_block = 0, next, run_block = 0, run_frame = 0;
+	unsigned long set_number;
+	struct cache_set *set;
+	unsigned int run = 0;
+	int i, invalid, res, replace;
+
+	for (; count; count--, block += step) {
+		if (block + dmc->block_size > dev_size)
+			break;
+		if (atomic_read(&dmc->pf_frames) >= atomic_read(&dmc->pf_target))
+			break; /* Prefetch partition is full */
+		set_number = hash_block(dmc, block);
+		set = &dmc->cache_sets[set_number];
+		base = set_number * dmc->assoc;
+		next = run_frame + run;
+
+		spin_lock(&set->set_spin_lock);
+		invalid = -1;
+		i = cache_find(dmc, base, block, &invalid);
+		if (i >= 0 || class_owner(dmc, set_number, block))
+			res = -1; /* Already cached */
+		else if (run && next >= base && next < base + dmc->assoc &&
+		         !is_state(dmc->states[next], (VALID | RESERVED))) {
+			cache_block = next; /* Extend the run */
+			res = 0;
+		} else if (invalid != -1) {
+			cache_block = base + invalid;
+			res = 0;
+		} else
+			res = dmc->policy->victim(dmc, set_number, block, &cache_block);
+		if (res != 0) {
+			spin_unlock(&set->set_spin_lock);
+			continue;
+		}
+		replace = is_state(dmc->states[cache_block], VALID);
+		if (replace && !dmc->pf_tags[cache_block])
+			pf_ghost_add(dmc, DEMAND_GHOST, dmc->tags[cache_block]);
+		if (!cache_insert(dmc, block, cache_block, POLICY_SEQ)) {
+			spin_unlock(&set->set_spin_lock);
+			break;
+		}
+		dmc->pf_tags[cache_block] = tag;
+		atomic_inc(&dmc->pf_frames);
+		spin_unlock(&set->set_spin_lock);
+
+		if (replace)
+			cache_stat_inc(dmc, replace);
+		cache_stat_inc(dmc, prefetch);
+
+		if (run && cache_block == next &&
+		    block == run_block + ((sector_t)run << dmc->block_shift)) {
+			run++;
+			continue;
+		}
+		if (run)
+			prefetch_run(dmc, run_block, run_frame, run);
+		run_block = block;
+		run_frame = cache_block;
+		run = 1;
+	}
 
-	return job;
+	if (run)
+		prefetch_run(dmc, run_block, run_frame, run);
+}
+
+/****************************************************************************
+ *  Functions for prefetching correlated random reads.
+ *  The successor table records which block followed which among the READs
+ *  that are not part of a stream, so that chains of random reads that repeat,
+ *  such as the path from the root of a B-tree to a leaf, are read ahead: a
+ *  READ of a recorded block prefetches those of its successors that followed
+ *  it at least CORR_MIN_CONF times more often than they were displaced.
+ *  The table is direct-mapped and takes corr_kb KB at most; 0 disables it.
+ *  A block only takes the entry of another one once the other's successors
+ *  have all decayed.
+ ****************************************************************************/
+
+#define CORR_WAYS	2	/* Successors kept per block */
+#define CORR_MAX_CONF	7	/* Saturation of a successor's count */
+#define CORR_MIN_CONF	2	/* Count needed to prefetch a successor */
+
+struct corr_entry {
+	sector_t block;
+	sector_t next[CORR_WAYS];	/* Blocks read right after it */
+	u8 conf[CORR_WAYS];		/* How often, less displacements */
+};
+
+static void corr_init(struct cache_c *dmc)
+{
+	spin_lock_init(&dmc->corr_lock);
+	dmc->corr = NULL;
+	dmc->corr_bits = 0;
+	dmc->corr_kb = DEFAULT_CORR_KB;
+	dmc->corr_last = GHOST_EMPTY;
 }
 
 /*
- * Handle a read cache miss:
- *  Update the metadata; fetch the necessary block from source device;
- *  store data to cache device.
+ * Size the table to at most kb KB, forgetting the successors seen so far.
  */
-static int cache_read_miss(struct cache_c *dmc, struct bio* bio,
-	                       sector_t cache_block) {
-	struct cacheblock *cache = dmc->cache;
-	unsigned int offset, head, tail;
-	struct kcached_job *job;
-	sector_t request_block, left;
+static int corr_resize(struct cache_c *dmc, unsigned int kb)
+{
+	unsigned long entries = 0;
+	struct corr_entry *corr = NULL, *old;
+
+	if (kb > MAX_CORR_KB)
+		return -EINVAL;
+	if (kb) {
+		entries = ((unsigned long)kb << 10) / sizeof(struct corr_entry);
+		if (!entries)
+			return -EINVAL;
+		entries = rounddown_pow_of_two(entries);
+		corr = vzalloc(entries * sizeof(struct corr_entry));
+		if (!corr)
+			return -ENOMEM;
+	}
 
-	offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
-	request_block = bio->bi_sector - offset;
+	spin_lock(&dmc->corr_lock);
+	old = dmc->corr;
+	dmc->corr = corr;
+	dmc->corr_bits = entries ? ilog2(entries) : 0;
+	dmc->corr_kb = kb;
+	dmc->corr_last = GHOST_EMPTY;
+	spin_unlock(&dmc->corr_lock);
 
-	if (cache[cache_block].state & VALID) {
-		DPRINTK("Replacing %llu->%llu",
-		        cache[cache_block].block, request_block);
-		dmc->replace++;
-	} else DPRINTK("Insert block %llu at empty frame %llu",
-		request_block, cache_block);
+	vfree(old);
+	return 0;
+}
 
-	cache_insert(dmc, request_block, cache_block); /* Update metadata first */
+static void corr_exit(struct cache_c *dmc)
+{
+	vfree(dmc->corr);
+}
 
-	job = new_kcached_job(dmc, bio, request_block, cache_block);
+static inline struct corr_entry *corr_entry(struct cache_c *dmc,
+	                                        sector_t block)
+{
+	return &dmc->corr[hash_64(block >> dmc->block_shift, dmc->corr_bits)];
+}
 
-	head = to_bytes(offset);
+/*
+ * Count next as a successor of block. Called with corr_lock held.
+ */
+static void corr_record(struct cache_c *dmc, sector_t block, sector_t next)
+{
+	struct corr_entry *e = corr_entry(dmc, block);
+	int i, weakest = 0;
+
+	if (e->block != block) {
+		for (i=0; i<CORR_WAYS; i++) {
+			if (e->conf[i]) { /* Let the owner decay first */
+				e->conf[i]--;
+				return;
+			}
+		}
+		memset(e, 0, sizeof(*e));
+		e->block = block;
+	}
 
-	left = (dmc->src_dev->bdev->bd_inode->i_size>>9) - request_block;
-	if (left < dmc->block_size) {
-		tail = to_bytes(left) - bio->bi_size - head;
-		job->src.count = left;
-		job->dest.count = left;
-	} else
-		tail = to_bytes(dmc->block_size) - bio->bi_size - head;
+	for (i=0; i<CORR_WAYS; i++) {
+		if (e->conf[i] && e->next[i] == next) {
+			if (e->conf[i] < CORR_MAX_CONF)
+				e->conf[i]++;
+			return;
+		}
+		if (e->conf[i] < e->conf[weakest])
+			weakest = i;
+	}
+	if (e->conf[weakest]) { /* Displace it only after repeated misses */
+		e->conf[weakest]--;
+		return;
+	}
+	e->next[weakest] = next;
+	e->conf[weakest] = 1;
+}
 
-	/* Requested block is aligned with a cache block */
-	if (0 == head && 0 == tail)
-		job->nr_pages= 0;
-	else /* Need new pages to store extra data */
-		job->nr_pages = dm_div_up(head, PAGE_SIZE) + dm_div_up(tail, PAGE_SIZE);
-	job->rw = READ; /* Fetch data from the source device */
+/*
+ * Record a random READ of block and prefetch its likely successors.
+ */
+static void corr_prefetch(struct cache_c *dmc, sector_t block)
+{
+	sector_t next[CORR_WAYS];
+	struct corr_entry *e;
+	int i, n = 0;
 
-	DPRINTK("Queue job for %llu (need %u pages)",
-	        bio->bi_sector, job->nr_pages);
-	queue_job(job);
+	spin_lock(&dmc->corr_lock);
+	if (!dmc->corr) {
+		spin_unlock(&dmc->corr_lock);
+		return;
+	}
+	if (dmc->corr_last != GHOST_EMPTY && dmc->corr_last != block)
+		corr_record(dmc, dmc->corr_last, block);
+	dmc->corr_last = block;
+
+	e = corr_entry(dmc, block);
+	if (e->block == block) {
+		for (i=0; i<CORR_WAYS; i++)
+			if (e->conf[i] >= CORR_MIN_CONF)
+				next[n++] = e->next[i];
+	}
+	spin_unlock(&dmc->corr_lock);
 
-	return 0;
+	for (i=0; i<n; i++) {
+		DPRINTK("Correlated prefetch of %llu after %llu", next[i], block);
+		prefetch_blocks(dmc, next[i], 1, dmc->block_size, PF_CORR);
+	}
 }
 
+/****************************************************************************
+ *  Functions for implementing the operations on a cache mapping.
+ ****************************************************************************/
+
+/* Returned by cache_map_set() when another class holds the bio's sectors */
+#define MAP_REROUTE	2
+
 /*
- * Handle a write cache miss:
- *  If write-through, forward the request to source device.
- *  If write-back, update the metadata; fetch the necessary block from source
- *  device; write to cache device.
+ * The part of the mapping done under the set lock: serve a hit, handle a miss
+ * or forward the bio to the source device. *hit is set on a cache hit. If the
+ * block is missed but another class holds some of its sectors, nothing is
+ * done; that class is stored in *owner and MAP_REROUTE is returned.
+ * Bios that were parked by requeue_bio() come back here directly, so that
+ * they are not counted or classified twice.
  */
-static int cache_write_miss(struct cache_c *dmc, struct bio* bio, sector_t cache_block) {
-	struct cacheblock *cache = dmc->cache;
-	unsigned int offset, head, tail;
-	struct kcached_job *job;
-	sector_t request_block, left;
+static int cache_map_set(struct cache_c *dmc, struct bio *bio,
+	                     sector_t request_block, unsigned int hint,
+	                     int bypass, int *hit, struct cache_c **owner)
+{
+	unsigned long set_number = hash_block(dmc, request_block);
+	struct cache_set *set = &dmc->cache_sets[set_number];
+	sector_t cache_block = 0;
+	int res;
 
-	if (dmc->write_policy == WRITE_THROUGH) { /* Forward request to souuce */
-		bio->bi_bdev = dmc->src_dev->bdev;
-		return 1;
+	spin_lock(&set->set_spin_lock);
+
+	res = cache_lookup(dmc, request_block, &cache_block);
+	if (1 != res && (*owner = class_owner(dmc, set_number, request_block))) {
+		spin_unlock(&set->set_spin_lock);
+		return MAP_REROUTE;
 	}
+	if (1 == res) { /* Cache hit; server request from cache */
+		*hit = 1;
+		res = cache_hit(dmc, bio, cache_block);
+		spin_unlock(&set->set_spin_lock);
+		if (2 == res) { /* Fetch the missing sub-blocks */
+			copy_subs(dmc, cache_block, READ, 0);
+			res = 0;
+		}
+		return res;
+	} else if (bypass) { /* Miss of a long sequential stream; do not cache */
+		spin_unlock(&set->set_spin_lock);
+		if (bio_data_dir(bio) == READ)
+			cache_stat_inc(dmc, uncached_seq_reads);
+		else
+			cache_stat_inc(dmc, uncached_seq_writes);
+	} else if (0 == res) { /* Cache miss; replacement block is found */
+		return cache_miss(dmc, bio, set, cache_block, hint);
+	} else if (2 == res) { /* Entire cache set is dirty; initiate a write-back */
+		res = prepare_write_back(dmc, cache_block, 1);
+		spin_unlock(&set->set_spin_lock);
+		if (res) {
+			write_back(dmc, cache_block, 1, 0);
+			cache_stat_inc(dmc, writeback);
+		}
+	} else
+		spin_unlock(&set->set_spin_lock);
 
-	offset = (unsigned int)(bio->bi_sector & dmc->block_mask);
-	request_block = bio->bi_sector - offset;
+	/* Forward to source device */
+	bio->bi_bdev = dmc->src_dev->bdev;
+	return 1;
+}
 
-	if (cache[cache_block].state & VALID) {
-		DPRINTK("Replacing %llu->%llu",
-		        cache[cache_block].block, request_block);
-		dmc->replace++;
-	} else DPRINTK("Insert block %llu at empty frame %llu",
-		request_block, cache_block);
+static int cache_map_split(struct cache_c *dmc, struct bio *bio,
+	                       int (*map)(struct cache_c *, struct bio *));
+
+/*
+ * Map a bio that was accounted for on another class, on the class that holds
+ * its sectors. The bio is split if it spans several blocks of the class, and
+ * follows its sectors again if they have moved to yet another class.
+ */
+static int cache_remap(struct cache_c *dmc, struct bio *bio)
+{
+	struct cache_c *owner;
+	int res, hit = 0;
+
+	for (;;) {
+		if ((bio->bi_sector & dmc->block_mask) + to_sector(bio->bi_size) >
+		    dmc->block_size)
+			return cache_map_split(dmc, bio, cache_remap);
+		res = cache_map_set(dmc, bio, bio->bi_sector -
+		                    (bio->bi_sector & dmc->block_mask), 0, 0,
+		                    &hit, &owner);
+		if (MAP_REROUTE != res)
+			break;
+		dmc = owner;
+	}
+	if (hit)
+		cache_stat_inc(dmc, cache_hits);
 
-	/* Write delay */
-	cache_insert(dmc, request_block, cache_block); /* Update metadata first */
-	set_state(cache[cache_block].state, DIRTY);
-	dmc->dirty_blocks++;
+	return res;
+}
 
-	job = new_kcached_job(dmc, bio, request_block, cache_block);
+/*
+ * Decide the mapping and perform necessary cache operations for a bio that
+ * falls within one cache block. Only the set the block hashes to is locked,
+ * so bios for different sets are mapped concurrently from any CPU.
+ */
+static int cache_map_block(struct cache_c *dmc, struct bio *bio)
+{
+	struct cache_c *owner;
+	sector_t request_block, offset, ra_block = 0;
+	unsigned int hint = 0, ra_count = 0;
+	unsigned long ra_step = 0;
+	u16 ra_tag = 0;
+	int res, bypass = 0, hit = 0;
 
-	head = to_bytes(offset);
-	left = (dmc->src_dev->bdev->bd_inode->i_size>>9) - request_block;
-	if (left < dmc->block_size) {
-		tail = to_bytes(left) - bio->bi_size - head;
-		job->src.count = left;
-		job->dest.count = left;
-	} else
-		tail = to_bytes(dmc->block_size) - bio->bi_size - head;
+	offset = bio->bi_sector & dmc->block_mask;
+	request_block = bio->bi_sector - offset;
 
-	if (0 == head && 0 == tail) { /* Requested is aligned with a cache block */
-		job->nr_pages = 0;
-		job->rw = WRITE;
-	} else if (head && tail){ /* Special case: need to pad both head and tail */
-		job->nr_pages = dm_div_up(to_bytes(job->src.count), PAGE_SIZE);
-		job->rw = READ;
-	} else {
-		if (head) { /* Fetch only head */
-			job->src.count = to_sector(head);
-			job->nr_pages = dm_div_up(head, PAGE_SIZE);
-		} else { /* Fetch only tail */
-			job->src.sector = bio->bi_sector + to_sector(bio->bi_size);
-			job->src.count = to_sector(tail);
-			job->nr_pages = dm_div_up(tail, PAGE_SIZE);
+
+
+	DPRINTK("Got a %s for %llu ((%llu:%llu), %u bytes)",
+	        bio_rw(bio) == WRITE ? "WRITE" : (bio_rw(bio) == READ ?
+	        "READ":"READA"), bio->bi_sector, request_block, offset,
+	        bio->bi_size);
+
+	if (dmc->admit)
+		admit_record(dmc, request_block);
+	if ((dmc->policy->prefetch || ACCESS_ONCE(dmc->readahead_kb) ||
+	     ACCESS_ONCE(dmc->skip_seq_thresh_kb)) &&
+	    seq_classify(dmc, bio, request_block, &bypass))
+		hint = POLICY_SEQ;
+
+	if (bio_data_dir(bio) == READ) {
+		cache_stat_inc(dmc, reads);
+		if (cache_read_hit_fast(dmc, bio, request_block)) {
+			res = hit = 1;
+			goto out;
 		}
-		job->rw = READ;
+	} else cache_stat_inc(dmc, writes);
+
+	res = cache_map_set(dmc, bio, request_block, hint, bypass, &hit, &owner);
+	if (MAP_REROUTE == res)
+		res = cache_remap(owner, bio);
+	else if (hit)
+		cache_stat_inc(dmc, cache_hits);
+
+out:
+	if (!hit && bio_data_dir(bio) == READ)
+		pf_partition_miss(dmc, request_block);
+	if ((hint & POLICY_SEQ) && !bypass && bio_data_dir(bio) == READ) {
+		seq_readahead(dmc, request_block, hit, &ra_block, &ra_count,
+		              &ra_step, &ra_tag);
+		if (ra_count) /* Read ahead of the stream */
+			prefetch_blocks(dmc, ra_block, ra_count, ra_step, ra_tag);
+	} else if (ACCESS_ONCE(dmc->corr_kb) && bio_data_dir(bio) == READ)
+		corr_prefetch(dmc, request_block);
+
+	return res;
+}
+
+/* Map the bios that were waiting for a frame in transition again */
+static void do_requeue(struct work_struct *work)
+{
+	struct cache_c *dmc = container_of(work, struct cache_c, requeue_work);
+	struct cache_c *owner;
+	struct bio *bio, *n;
+	int r, hit;
+
+	spin_lock_irq(&_requeue_lock);
+	bio = bio_list_get(&dmc->requeue);
+	spin_unlock_irq(&_requeue_lock);
+
+	while (bio) {
+		n = bio->bi_next;
+		bio->bi_next = NULL;
+		r = cache_map_set(dmc, bio, bio->bi_sector -
+		                  (bio->bi_sector & dmc->block_mask), 0, 0, &hit,
+		                  &owner);
+		if (MAP_REROUTE == r) /* Its sectors went to another class */
+			r = cache_remap(owner, bio);
+		if (r == 1)
+			generic_make_request(bio);
+		else if (r < 0)
+			bio_endio(bio, r);
+		bio = n;
+	}
+}
+
+/*
+ * A bio that spans several cache blocks is cloned per block, and every piece
+ * is mapped on its own: hits are served from the cache, misses from the
+ * source device. The bio completes once all of its pieces have completed.
+ */
+struct split_bio {
+	struct bio *bio;	/* The bio split */
+	atomic_t pending;	/* Pieces not completed yet */
+	int error;
+};
+
+static struct kmem_cache *_split_cache;
+static mempool_t *_split_pool;
+static struct bio_set *_split_bioset;
+
+static int split_init(void)
+{
+	_split_cache = kmem_cache_create("kcached-split",
+	                                 sizeof(struct split_bio),
+	                                 __alignof__(struct split_bio),
+	                                 0, NULL);
+	if (!_split_cache)
+		return -ENOMEM;
+
+	_split_pool = mempool_create(MIN_JOBS, mempool_alloc_slab,
+	                             mempool_free_slab, _split_cache);
+	if (!_split_pool)
+		goto bad;
+
+	_split_bioset = bioset_create(MIN_JOBS, 0);
+	if (!_split_bioset) {
+		mempool_destroy(_split_pool);
+		goto bad;
 	}
 
-	queue_job(job);
-
 	return 0;
-}
 
-/* Handle cache misses */
-static int cache_miss(struct cache_c *dmc, struct bio* bio, sector_t cache_block) {
-	if (bio_data_dir(bio) == READ)
-		return cache_read_miss(dmc, bio, cache_block);
-	else
-		return cache_write_miss(dmc, bio, cache_block);
+bad:
+	kmem_cache_destroy(_split_cache);
+	return -ENOMEM;
 }
 
+static void split_exit(void)
+{
+	bioset_free(_split_bioset);
+	mempool_destroy(_split_pool);
+	kmem_cache_destroy(_split_cache);
+	_split_bioset = NULL;
+	_split_pool = NULL;
+	_split_cache = NULL;
+}
 
-/****************************************************************************
- *  Functions for implementing the operations on a cache mapping.
- ****************************************************************************/
-
-/*
- * Decide the mapping and perform necessary cache operations for a bio request.
- */
-static int cache_map(struct dm_target *ti, struct bio *bio,
-		      union map_info *map_context)
+static void split_put(struct split_bio *sb)
 {
-	struct cache_c *dmc = (struct cache_c *) ti->private;
-	sector_t request_block, cache_block = 0, offset,i;
-	int res;
-	if(dmc->step0==0)
-	{
-	dmc->block_size = 32; 
-	/*8，16，24，32*/
-	dmc->block_shift = ffs(dmc->block_size) - 1;
-	dmc->block_mask = dmc->block_size - 1;
-	ti->split_io = dmc->block_size;
-   
-	bio->bi_bdev = dmc->src_dev->bdev;
-	dmc->step0++;
-	return 1;
+	if (atomic_dec_and_test(&sb->pending)) {
+		bio_endio(sb->bio, sb->error);
+		mempool_free(sb, _split_pool);
 	}
+}
 
+static void split_destructor(struct bio *clone)
+{
+	bio_free(clone, _split_bioset);
+}
 
+static void split_endio(struct bio *clone, int error)
+{
+	struct split_bio *sb = clone->bi_private;
 
+	if (error)
+		sb->error = error;
+	bio_put(clone);
+	split_put(sb);
+}
 
+/*
+ * Clone len sectors of bio from sector on, sharing its pages.
+ */
+static struct bio *split_clone(struct bio *bio, sector_t sector,
+	                           unsigned int len)
+{
+	unsigned int skip = to_bytes(sector - bio->bi_sector);
+	unsigned int size = to_bytes(len), left, nr = 1;
+	struct bio_vec *bv, *first;
+	struct bio *clone;
+
+	for (bv = bio->bi_io_vec + bio->bi_idx; skip >= bv->bv_len; bv++)
+		skip -= bv->bv_len;
+	first = bv;
+	for (left = size + skip; left > bv->bv_len; bv++, nr++)
+		left -= bv->bv_len;
+
+	clone = bio_alloc_bioset(GFP_NOIO, nr, _split_bioset);
+	clone->bi_destructor = split_destructor;
+	memcpy(clone->bi_io_vec, first, nr * sizeof(*first));
+	clone->bi_io_vec[nr - 1].bv_len = left; /* Trim the last segment */
+	clone->bi_io_vec[0].bv_offset += skip; /* and the first */
+	clone->bi_io_vec[0].bv_len -= skip;
+	clone->bi_sector = sector;
+	clone->bi_bdev = bio->bi_bdev;
+	clone->bi_rw = bio->bi_rw;
+	clone->bi_vcnt = nr;
+	clone->bi_idx = 0;
+	clone->bi_size = size;
+
+	return clone;
+}
 
+/*
+ * Map a bio that spans several cache blocks, each piece with map(). The bio
+ * is held by an extra count until all of its pieces have been issued.
+ */
+static int cache_map_split(struct cache_c *dmc, struct bio *bio,
+	                       int (*map)(struct cache_c *, struct bio *))
+{
+	sector_t sector = bio->bi_sector;
+	sector_t end = bio->bi_sector + to_sector(bio->bi_size);
+	struct split_bio *sb;
+	struct bio *clone;
+	unsigned int len;
+	int r;
 
-	if(to_sector(bio->bi_size)!=dmc->block_size)
-	{
-		bio->bi_bdev = dmc->src_dev->bdev;
-		return 1;
+	DPRINTK("Split %llu (%u bytes)", bio->bi_sector, bio->bi_size);
+
+	sb = mempool_alloc(_split_pool, GFP_NOIO);
+	sb->bio = bio;
+	sb->error = 0;
+	atomic_set(&sb->pending, 1);
+
+	while (sector < end) {
+		len = min((sector_t)(dmc->block_size -
+		          (sector & dmc->block_mask)), end - sector);
+		clone = split_clone(bio, sector, len);
+		clone->bi_end_io = split_endio;
+		clone->bi_private = sb;
+		atomic_inc(&sb->pending);
+
+		r = map(dmc, clone);
+		if (r == 1) /* Remapped */
+			generic_make_request(clone);
+		else if (r < 0)
+			bio_endio(clone, r);
+		sector += len;
 	}
-	offset = bio->bi_sector & dmc->block_mask;
-	request_block = bio->bi_sector - offset;
-
 
+	split_put(sb);
+	return 0;
+}
 
-	DPRINTK("Got a %s for %llu ((%llu:%llu), %u bytes)",
-	        bio_rw(bio) == WRITE ? "WRITE" : (bio_rw(bio) == READ ?
-	        "READ":"READA"), bio->bi_sector, request_block, offset,
-	        bio->bi_size);
-
-	if (bio_data_dir(bio) == READ) dmc->reads++;
-	else dmc->writes++;
+/*
+ * Map a bio request on the block size class it fits best. A bio that spans
+ * several cache blocks of the class is split at block boundaries, and each
+ * piece is mapped on its own by cache_map_block().
+ */
+static int cache_map(struct dm_target *ti, struct bio *bio,
+		      union map_info *map_context)
+{
+	struct cache_c *dmc = (struct cache_c *) ti->private;
 
-	res = cache_lookup(dmc, request_block, &cache_block);
-	if (1 == res)  /* Cache hit; server request from cache */
-		return cache_hit(dmc, bio, cache_block);
-	else if (0 == res) /* Cache miss; replacement block is found */
-		return cache_miss(dmc, bio, cache_block);
-	else if (2 == res) { /* Entire cache set is dirty; initiate a write-back */
-		write_back(dmc, cache_block, 1);
-		dmc->writeback++;
+	if (!bio->bi_size) { /* Nothing to cache, e.g. an empty flush */
+		bio->bi_bdev = dmc->src_dev->bdev;
+		return 1;
 	}
 
-	/* Forward to source device */
-	bio->bi_bdev = dmc->src_dev->bdev;
+	dmc = bio_class(dmc, bio);
+	if ((bio->bi_sector & dmc->block_mask) + to_sector(bio->bi_size) >
+	    dmc->block_size)
+		return cache_map_split(dmc, bio, cache_map_block);
 
-	return 1;
+	return cache_map_block(dmc, bio);
 }
 
+/*
+ * Every block size class keeps its metadata at the end of the cache device,
+ * the first class last: a header sector at meta_sector, preceded by the tags
+ * of its frames.
+ */
 struct meta_dmc {
 	sector_t size;
 	unsigned int block_size;
 	unsigned int assoc;
 	unsigned int write_policy;
 	unsigned int chksum;
+	sector_t valid;		/* Frames holding a block when stored */
+	sector_t dirty;		/* Of them, those that were dirty */
 };
 
+static void cache_occupancy(struct cache_c *dmc, sector_t *valid,
+	                        sector_t *dirty);
+
 /* Load metadata stored by previous session from disk. */
 static int load_metadata(struct cache_c *dmc) {
 	struct dm_io_region where;
 	unsigned long bits;
-	sector_t dev_size = dmc->cache_dev->bdev->bd_inode->i_size >> 9;
 	sector_t meta_size, *meta_data, i, j, index = 0, limit, order;
 	struct meta_dmc *meta_dmc;
 	unsigned int chksum = 0, chksum_sav, consecutive_blocks;
@@ -1285,17 +4799,26 @@ static int load_metadata(struct cache_c *dmc) {
 	}
 
 	where.bdev = dmc->cache_dev->bdev;
-	where.sector = dev_size - 1;
+	where.sector = dmc->meta_sector;
 	where.count = 1;
 	dm_io_sync_vm(1, &where, READ, meta_dmc, &bits, dmc);
 	DPRINTK("Loaded cache conf: block size(%u), cache size(%llu), " \
-	        "associativity(%u), write policy(%u), chksum(%u)",
+	        "associativity(%u), write policy(%u), chksum(%u), " \
+	        "blocks(%llu used, %llu dirty)",
 	        meta_dmc->block_size, meta_dmc->size,
 	        meta_dmc->assoc, meta_dmc->write_policy,
-	        meta_dmc->chksum);
+	        meta_dmc->chksum, meta_dmc->valid, meta_dmc->dirty);
+
+	if (meta_dmc->block_size > MAX_BLOCK_SIZE) {
+		DMERR("load_metadata: Block size %u is too large",
+		      meta_dmc->block_size);
+		vfree((void *)meta_dmc);
+		return 1;
+	}
 
 	dmc->block_size = meta_dmc->block_size;
 	dmc->block_shift = ffs(dmc->block_size) - 1;
+	dmc->sub_shift = min(dmc->block_shift, (unsigned int)SUB_BLOCK_SHIFT);
 	dmc->block_mask = dmc->block_size - 1;
 
 	dmc->size = meta_dmc->size;
@@ -1312,18 +4835,17 @@ static int load_metadata(struct cache_c *dmc) {
 	vfree((void *)meta_dmc);
 
 
-	order = dmc->size * sizeof(struct cacheblock);
+	order = dmc->size * cache_frames_mem(dmc);
 	DMINFO("Allocate %lluKB (%luB per) mem for %llu-entry cache" \
 	       "(capacity:%lluMB, associativity:%u, block size:%u " \
 	       "sectors(%uKB), %s)",
-	       (unsigned long long) order >> 10, (unsigned long) sizeof(struct cacheblock),
+	       (unsigned long long) order >> 10, cache_frames_mem(dmc),
 	       (unsigned long long) dmc->size,
 	       (unsigned long long) dmc->size * dmc->block_size >> (20-SECTOR_SHIFT),
 	       dmc->assoc, dmc->block_size,
 	       dmc->block_size >> (10-SECTOR_SHIFT),
 	       dmc->write_policy ? "write-back" : "write-through");
-	dmc->cache = (struct cacheblock *)vmalloc(order);
-	if (!dmc->cache) {
+	if (alloc_cache_frames(dmc)) {
 		DMERR("load_metadata: Unable to allocate memory");
 		return 1;
 	}
@@ -1339,12 +4861,12 @@ static int load_metadata(struct cache_c *dmc) {
 	meta_data = (sector_t *)vmalloc(to_bytes(min(meta_size, limit)));
 	if (!meta_data) {
 		DMERR("load_metadata: Unable to allocate memory");
-		vfree((void *)dmc->cache);
+		free_cache_frames(dmc);
 		return 1;
 	}
 
 	while(index < meta_size) {
-		where.sector = dev_size - 1 - meta_size + index;
+		where.sector = dmc->meta_sector - meta_size + index;
 		where.count = min(meta_size - index, limit);
 		dm_io_sync_vm(1, &where, READ, meta_data, &bits, dmc);
 
@@ -1352,10 +4874,10 @@ static int load_metadata(struct cache_c *dmc) {
 		     j<to_bytes(where.count)/sizeof(sector_t) && i<dmc->size;
 		     i++, j++) {
 			if(meta_data[j]) {
-				dmc->cache[i].block = meta_data[j];
-				dmc->cache[i].state = 1;
+				set_tag(dmc, i, meta_data[j]);
+				dmc->states[i] = VALID;
 			} else
-				dmc->cache[i].state = 0;
+				dmc->states[i] = INVALID;
 		}
 		chksum = csum_partial((char *)meta_data, to_bytes(where.count), chksum);
 		index += where.count;
@@ -1365,12 +4887,13 @@ static int load_metadata(struct cache_c *dmc) {
 
 	if (chksum != chksum_sav) { /* Check the checksum of the metadata */
 		DPRINTK("Cache metadata loaded from disk is corrupted");
-		vfree((void *)dmc->cache);
+		free_cache_frames(dmc);
 		return 1;
 	}
 
 	DMINFO("Cache metadata loaded from disk (offset %llu)",
-	       (unsigned long long) dev_size - 1 - (unsigned long long) meta_size);;
+	       (unsigned long long) dmc->meta_sector -
+	       (unsigned long long) meta_size);
 
 	return 0;
 }
@@ -1379,7 +4902,6 @@ static int load_metadata(struct cache_c *dmc) {
 static int dump_metadata(struct cache_c *dmc) {
 	struct dm_io_region where;
 	unsigned long bits;
-	sector_t dev_size = dmc->cache_dev->bdev->bd_inode->i_size >> 9;
 	sector_t meta_size, i, j, index = 0, limit, *meta_data;
 	struct meta_dmc *meta_dmc;
 	unsigned int chksum = 0;
@@ -1394,7 +4916,7 @@ static int dump_metadata(struct cache_c *dmc) {
 
 	where.bdev = dmc->cache_dev->bdev;
 	while(index < meta_size) {
-		where.sector = dev_size - 1 - meta_size + index;
+		where.sector = dmc->meta_sector - meta_size + index;
 		where.count = min(meta_size - index, limit);
 
 		for (i=to_bytes(index)/sizeof(sector_t), j=0;
@@ -1403,7 +4925,7 @@ static int dump_metadata(struct cache_c *dmc) {
 			/* Assume all invalid cache blocks store 0. We lose the block that
 			 * is actually mapped to offset 0.
 			 */
-			meta_data[j] = dmc->cache[i].state ? dmc->cache[i].block : 0;
+			meta_data[j] = dmc->states[i] ? dmc->tags[i] : 0;
 		}
 		chksum = csum_partial((char *)meta_data, to_bytes(where.count), chksum);
 
@@ -1424,23 +4946,160 @@ static int dump_metadata(struct cache_c *dmc) {
 	meta_dmc->assoc = dmc->assoc;
 	meta_dmc->write_policy = dmc->write_policy;
 	meta_dmc->chksum = chksum;
+	cache_occupancy(dmc, &meta_dmc->valid, &meta_dmc->dirty);
 
 	DPRINTK("Store metadata to disk: block size(%u), cache size(%llu), " \
-	        "associativity(%u), write policy(%u), checksum(%u)",
+	        "associativity(%u), write policy(%u), checksum(%u), " \
+	        "blocks(%llu used, %llu dirty)",
 	        meta_dmc->block_size, (unsigned long long) meta_dmc->size,
 	        meta_dmc->assoc, meta_dmc->write_policy,
-	        meta_dmc->chksum);
+	        meta_dmc->chksum, (unsigned long long) meta_dmc->valid,
+	        (unsigned long long) meta_dmc->dirty);
 
-	where.sector = dev_size - 1;
+	where.sector = dmc->meta_sector;
 	where.count = 1;
 	dm_io_sync_vm(1, &where, WRITE, meta_dmc, &bits, dmc);
 
 	vfree((void *)meta_dmc);
 
 	DMINFO("Cache metadata saved to disk (offset %llu)",
-	       (unsigned long long) dev_size - 1 - (unsigned long long) meta_size);
+	       (unsigned long long) dmc->meta_sector -
+	       (unsigned long long) meta_size);
+
+	return 0;
+}
+
+/*
+ * Add a block size class to a cache. It takes the configuration of the first
+ * class, but has its own frames, replacement policy state, streams, page pool
+ * and stats; the devices and I/O clients are shared. Its frames follow those
+ * of the previous class on the cache device, and its metadata precedes theirs.
+ */
+static int class_create(struct cache_c *top, unsigned int block_size,
+	                    sector_t size)
+{
+	struct cache_c *prev = top->classes[top->nr_classes - 1], *dmc;
+	int r = -ENOMEM;
+
+	dmc = kzalloc(sizeof(*dmc), GFP_KERNEL);
+	if (!dmc)
+		return -ENOMEM;
+
+	dmc->src_dev = top->src_dev;
+	dmc->cache_dev = top->cache_dev;
+	dmc->io_client = top->io_client;
+	dmc->kcp_client = top->kcp_client;
+	dmc->top = top;
+
+	dmc->block_size = block_size;
+	dmc->block_shift = ffs(dmc->block_size) - 1;
+	dmc->sub_shift = min(dmc->block_shift, (unsigned int)SUB_BLOCK_SHIFT);
+	dmc->block_mask = dmc->block_size - 1;
+	dmc->size = size;
+	dmc->bits = ffs(dmc->size) - 1;
+	dmc->assoc = (unsigned long)size / ((unsigned long)top->size / top->assoc);
+	/* Hash by the same region as the first class; see class_owner() */
+	dmc->consecutive_shift = top->block_shift + top->consecutive_shift -
+	                         dmc->block_shift;
+	dmc->region_shift = top->region_shift;
+	dmc->write_policy = top->write_policy;
+	dmc->early_read = top->early_read;
+	dmc->policy = top->policy;
+	dmc->data_start = prev->data_start + prev->size * prev->block_size;
+	dmc->meta_sector = prev->meta_sector - 1 -
+	                   dm_div_up(prev->size * sizeof(sector_t), 512);
+
+	DMINFO("Allocate %lluKB (%luB per) mem for %llu-entry class" \
+	       "(capacity:%lluMB, associativity:%u, block size:%u " \
+	       "sectors(%uKB))",
+	       (unsigned long long) dmc->size * cache_frames_mem(dmc) >> 10,
+	       cache_frames_mem(dmc), (unsigned long long) dmc->size,
+	       (unsigned long long) dmc->size * dmc->block_size >>
+	       (20-SECTOR_SHIFT), dmc->assoc, dmc->block_size,
+	       dmc->block_size >> (10-SECTOR_SHIFT));
+
+	r = kcached_init(dmc);
+	if (r)
+		goto bad;
+	dmc->stats = alloc_percpu(struct cache_stats);
+	if (!dmc->stats) {
+		r = -ENOMEM;
+		goto bad1;
+	}
+	r = alloc_cache_frames(dmc);
+	if (r)
+		goto bad2;
+	memset(dmc->states, INVALID, dmc->size * sizeof(u8));
+	r = dmc->policy->init(dmc);
+	if (r)
+		goto bad3;
+	r = seq_init(dmc);
+	if (r)
+		goto bad4;
+	r = pf_partition_init(dmc);
+	if (r)
+		goto bad5;
+	corr_init(dmc);
+	if (top->admit) {
+		r = admit_init(dmc);
+		if (r)
+			goto bad6;
+	}
 
+	top->classes[top->nr_classes++] = dmc;
 	return 0;
+
+bad6:
+	pf_partition_exit(dmc);
+bad5:
+	seq_exit(dmc);
+bad4:
+	dmc->policy->exit(dmc);
+bad3:
+	free_cache_frames(dmc);
+bad2:
+	free_percpu(dmc->stats);
+bad1:
+	kcached_client_destroy(dmc);
+bad:
+	kfree(dmc);
+	return r;
+}
+
+/*
+ * Free a block size class other than the first, once kcached_client_destroy()
+ * has waited for its jobs.
+ */
+static void class_free(struct cache_c *dmc)
+{
+	free_percpu(dmc->stats);
+	admit_exit(dmc);
+	corr_exit(dmc);
+	pf_partition_exit(dmc);
+	seq_exit(dmc);
+	dmc->policy->exit(dmc);
+	free_cache_frames(dmc);
+	kfree(dmc);
+}
+
+/*
+ * Parse a comma-separated list of numbers, one per block size class.
+ * Returns the number of them, or -1.
+ */
+static int parse_classes(const char *arg, unsigned long long *vals)
+{
+	int n = 0, len;
+
+	for (;;) {
+		if (n == MAX_CLASSES || sscanf(arg, "%llu%n", &vals[n], &len) != 1)
+			return -1;
+		n++;
+		arg += len;
+		if (!*arg)
+			return n;
+		if (*arg++ != ',')
+			return -1;
+	}
 }
 
 /*
@@ -1449,19 +5108,23 @@ static int dump_metadata(struct cache_c *dmc) {
  *  arg[1]: path to cache device
  *  arg[2]: cache persistence (if set, cache conf is loaded from disk)
  * Cache configuration parameters (if not set, default values are used.
- *  arg[3]: cache block size (in sectors)
- *  arg[4]: cache size (in blocks)
- *  arg[5]: cache associativity
+ *  arg[3]: cache block size (in sectors), or the block sizes of several
+ *          classes in increasing order, comma-separated (e.g. 8,256)
+ *  arg[4]: cache size (in blocks), one per class, comma-separated
+ *  arg[5]: cache associativity of the first class; the other classes have
+ *          as many sets
  *  arg[6]: write caching policy
+ *  arg[7]: replacement policy (clock, lru, 2q, arc or sarc)
+ *  arg[8]: admission filter for read misses (none or tinylfu)
  */
 static int cache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
 	struct cache_c *dmc;
 	unsigned int consecutive_blocks, persistence = 0;
-	sector_t localsize, i, order;
+	unsigned long long block_sizes[MAX_CLASSES], sizes[MAX_CLASSES];
+	sector_t localsize, i, order, nr_sets;
 	sector_t data_size, meta_size, dev_size;
-	unsigned long long cache_size;
-	int r = -EINVAL;
+	int r = -EINVAL, nr_classes = 1, c;
 
 	if (argc < 2) {
 		ti->error = "dm-cache: Need at least 2 arguments (src dev and cache dev)";
@@ -1474,6 +5137,11 @@ static int cache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		r = ENOMEM;
 		goto bad;
 	}
+	dmc->top = dmc;
+	dmc->classes[0] = dmc;
+	dmc->nr_classes = 1;
+	dmc->data_start = 0;
+	dmc->region_shift = 0;
 
 	r = dm_get_device(ti, argv[0],
 			  dm_table_get_mode(ti->table), &dmc->src_dev);
@@ -1508,56 +5176,77 @@ static int cache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad5;
 	}
 
+	dmc->stats = alloc_percpu(struct cache_stats);
+	if (!dmc->stats) {
+		ti->error = "Unable to allocate memory";
+		r = -ENOMEM;
+		goto bad6;
+	}
+
 	if (argc >= 3) {
 		if (sscanf(argv[2], "%u", &persistence) != 1) {
 			ti->error = "dm-cache: Invalid cache persistence";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 		}
 	}
 	if (1 == persistence) {
 		if (0) {
 			ti->error = "dm-cache: Invalid cache configuration";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 		}
 		goto init; /* Skip reading cache parameters from command line */
 	} else if (persistence != 0) {
 			ti->error = "dm-cache: Invalid cache persistence";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 	}
 
 	if (argc >= 4) {
-		if (sscanf(argv[3], "%u", &dmc->block_size) != 1) {
+		nr_classes = parse_classes(argv[3], block_sizes);
+		if (nr_classes < 1) {
 			ti->error = "dm-cache: Invalid block size";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 		}
-		if (!dmc->block_size || (dmc->block_size & (dmc->block_size - 1))) {
-			ti->error = "dm-cache: Invalid block size";
-			r = -EINVAL;
-			goto bad6;
+		for (c=0; c<nr_classes; c++) {
+			if (!block_sizes[c] ||
+			    (block_sizes[c] & (block_sizes[c] - 1)) ||
+			    block_sizes[c] > MAX_BLOCK_SIZE ||
+			    (c && block_sizes[c] <= block_sizes[c-1])) {
+				ti->error = "dm-cache: Invalid block size";
+				r = -EINVAL;
+				goto bad7;
+			}
 		}
 	} else
-	dmc->block_size = DEFAULT_BLOCK_SIZE;
+		block_sizes[0] = DEFAULT_BLOCK_SIZE;
+	dmc->block_size = block_sizes[0];
 	dmc->block_shift = ffs(dmc->block_size) - 1;
+	dmc->sub_shift = min(dmc->block_shift, (unsigned int)SUB_BLOCK_SHIFT);
 	dmc->block_mask = dmc->block_size - 1;
 
 	if (argc >= 5) {
-		if (sscanf(argv[4], "%llu", &cache_size) != 1) {
-			ti->error = "dm-cache: Invalid cache size";
+		if (parse_classes(argv[4], sizes) != nr_classes) {
+			ti->error = "dm-cache: Need a cache size per block size";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 		}
-		dmc->size = (sector_t) cache_size;
-		if (!dmc->size || (dmc->size & (dmc->size - 1))) {
-			ti->error = "dm-cache: Invalid cache size";
-			r = -EINVAL;
-			goto bad6;
+		for (c=0; c<nr_classes; c++) {
+			if (!sizes[c] || (sizes[c] & (sizes[c] - 1))) {
+				ti->error = "dm-cache: Invalid cache size";
+				r = -EINVAL;
+				goto bad7;
+			}
 		}
+	} else if (nr_classes > 1) {
+		ti->error = "dm-cache: Need a cache size per block size";
+		r = -EINVAL;
+		goto bad7;
 	} else
-		dmc->size = DEFAULT_CACHE_SIZE;
+		sizes[0] = DEFAULT_CACHE_SIZE;
+	dmc->size = (sector_t) sizes[0];
 	localsize = dmc->size;
 	dmc->bits = ffs(dmc->size) - 1;
 
@@ -1565,21 +5254,32 @@ static int cache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		if (sscanf(argv[5], "%u", &dmc->assoc) != 1) {
 			ti->error = "dm-cache: Invalid cache associativity";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 		}
 		if (!dmc->assoc || (dmc->assoc & (dmc->assoc - 1)) ||
 			dmc->size < dmc->assoc) {
 			ti->error = "dm-cache: Invalid cache associativity";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 		}
 	} else
 		dmc->assoc = DEFAULT_CACHE_ASSOC;
+	nr_sets = (unsigned long)dmc->size / dmc->assoc;
+	for (c=1; c<nr_classes; c++) {
+		if (sizes[c] < nr_sets) { /* Every class needs as many sets */
+			ti->error = "dm-cache: Invalid cache size";
+			r = -EINVAL;
+			goto bad7;
+		}
+	}
 
 	DMINFO("%lld", dmc->cache_dev->bdev->bd_inode->i_size);
 	dev_size = dmc->cache_dev->bdev->bd_inode->i_size >> 9;
-	data_size = dmc->size * dmc->block_size;
-	meta_size = dm_div_up(dmc->size * sizeof(sector_t), 512) + 1;
+	data_size = meta_size = 0;
+	for (c=0; c<nr_classes; c++) {
+		data_size += (sector_t) sizes[c] * block_sizes[c];
+		meta_size += dm_div_up(sizes[c] * sizeof(sector_t), 512) + 1;
+	}
 	if ((data_size + meta_size) > dev_size) {
 		DMERR("Requested cache size exeeds the cache device's capacity" \
 		      "(%llu+%llu>%llu)",
@@ -1587,67 +5287,131 @@ static int cache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
   		      (unsigned long long) dev_size);
 		ti->error = "dm-cache: Invalid cache size";
 		r = -EINVAL;
-		goto bad6;
+		goto bad7;
 	}
+	dmc->meta_sector = dev_size - 1;
+
+	/*
+	 * Consecutive blocks share a set as in a cache of the first class alone,
+	 * unless a block of the largest class spans more; the other classes hash
+	 * by the same region.
+	 */
 	consecutive_blocks = dmc->assoc < CONSECUTIVE_BLOCKS ?
 	                     dmc->assoc : CONSECUTIVE_BLOCKS;
 	dmc->consecutive_shift = ffs(consecutive_blocks) - 1;
+	dmc->region_shift = ffs(block_sizes[nr_classes - 1]) - 1;
+	if (dmc->block_shift + dmc->consecutive_shift < dmc->region_shift)
+		dmc->consecutive_shift = dmc->region_shift - dmc->block_shift;
 
 	if (argc >= 7) {
 		if (sscanf(argv[6], "%u", &dmc->write_policy) != 1) {
 			ti->error = "dm-cache: Invalid cache write policy";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 		}
 		if (dmc->write_policy != 0 && dmc->write_policy != 1) {
 			ti->error = "dm-cache: Invalid cache write policy";
 			r = -EINVAL;
-			goto bad6;
+			goto bad7;
 		}
 	} else
 		dmc->write_policy = DEFAULT_WRITE_POLICY;
 
-	order = dmc->size * sizeof(struct cacheblock);
+	order = dmc->size * cache_frames_mem(dmc);
 	localsize = data_size >> 11;
 	DMINFO("Allocate %lluKB (%luB per) mem for %llu-entry cache" \
 	       "(capacity:%lluMB, associativity:%u, block size:%u " \
 	       "sectors(%uKB), %s)",
-	       (unsigned long long) order >> 10, (unsigned long) sizeof(struct cacheblock),
+	       (unsigned long long) order >> 10, cache_frames_mem(dmc),
 	       (unsigned long long) dmc->size,
-	       (unsigned long long) data_size >> (20-SECTOR_SHIFT),
+	       (unsigned long long) dmc->size * dmc->block_size >> (20-SECTOR_SHIFT),
 	       dmc->assoc, dmc->block_size,
 	       dmc->block_size >> (10-SECTOR_SHIFT),
 	       dmc->write_policy ? "write-back" : "write-through");
 
-	dmc->cache = (struct cacheblock *)vmalloc(order);
-	if (!dmc->cache) {
+	if (alloc_cache_frames(dmc)) {
 		ti->error = "Unable to allocate memory";
 		r = -ENOMEM;
-		goto bad6;
+		goto bad7;
 	}
 
 init:	/* Initialize the cache structs */
-	for (i=0; i<dmc->size; i++) {
-		bio_list_init(&dmc->cache[i].bios);
-		if(!persistence) dmc->cache[i].state = 0;
-		dmc->cache[i].counter = 0;
-		spin_lock_init(&dmc->cache[i].lock);
-	}
-
-	dmc->counter = 0;
-	dmc->dirty_blocks = 0;
-	dmc->reads = 0;
-	dmc->writes = 0;
-	dmc->cache_hits = 0;
-	dmc->replace = 0;
-	dmc->writeback = 0;
-	dmc->dirty = 0;
-	dmc->step0 = 0;
-
-	ti->split_io = dmc->block_size;
+	if (!persistence)
+		memset(dmc->states, INVALID, dmc->size * sizeof(u8));
+
+	dmc->early_read = 0;
+
+	if (argc >= 8) {
+		dmc->policy = find_policy(argv[7]);
+		if (!dmc->policy) {
+			ti->error = "dm-cache: Invalid cache replacement policy";
+			r = -EINVAL;
+			goto bad8;
+		}
+	} else
+		dmc->policy = &DEFAULT_REPLACEMENT_POLICY;
+
+	r = dmc->policy->init(dmc);
+	if (r) {
+		ti->error = "Unable to allocate memory";
+		goto bad8;
+	}
+	DMINFO("Replacement policy: %s", dmc->policy->name);
+
+	r = seq_init(dmc);
+	if (r) {
+		ti->error = "Unable to allocate memory";
+		goto bad9;
+	}
+
+	r = pf_partition_init(dmc);
+	if (r) {
+		ti->error = "Unable to allocate memory";
+		goto bad10;
+	}
+	corr_init(dmc);
+
+	dmc->admit = NULL;
+	if (argc >= 9 && strcmp(argv[8], "none")) {
+		if (strcmp(argv[8], "tinylfu")) {
+			ti->error = "dm-cache: Invalid cache admission filter";
+			r = -EINVAL;
+			goto bad11;
+		}
+		r = admit_init(dmc);
+		if (r) {
+			ti->error = "Unable to allocate memory";
+			goto bad11;
+		}
+	}
+
+	for (c=1; c<nr_classes; c++) {
+		r = class_create(dmc, block_sizes[c], (sector_t) sizes[c]);
+		if (r) {
+			ti->error = "Unable to allocate memory";
+			goto bad12;
+		}
+	}
+
 	ti->private = dmc;
 	return 0;
 
+bad12:
+	while (dmc->nr_classes > 1) {
+		kcached_client_destroy(dmc->classes[--dmc->nr_classes]);
+		class_free(dmc->classes[dmc->nr_classes]);
+	}
+	admit_exit(dmc);
+bad11:
+	pf_partition_exit(dmc);
+bad10:
+	seq_exit(dmc);
+bad9:
+	dmc->policy->exit(dmc);
+bad8:
+	free_cache_frames(dmc);
+bad7:
+	free_percpu(dmc->stats);
 bad6:
 	kcached_client_destroy(dmc);
 bad5:
@@ -1665,26 +5429,99 @@ bad:
 }
 
 
-static void cache_flush(struct cache_c *dmc)
+/*
+ * Add the per-CPU stats of a block size class to sum.
+ */
+static void cache_stats_fold(struct cache_c *dmc, struct cache_stats *sum)
+{
+	struct cache_stats *stats;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(dmc->stats, cpu);
+		sum->reads += stats->reads;
+		sum->writes += stats->writes;
+		sum->cache_hits += stats->cache_hits;
+		sum->replace += stats->replace;
+		sum->writeback += stats->writeback;
+		sum->dirty += stats->dirty;
+		sum->prefetch += stats->prefetch;
+		sum->prefetch_hits += stats->prefetch_hits;
+		sum->prefetch_unused += stats->prefetch_unused;
+		sum->stride_hits += stats->stride_hits;
+		sum->corr_hits += stats->corr_hits;
+		sum->page_stalls += stats->page_stalls;
+		sum->partial_writes += stats->partial_writes;
+		sum->fills += stats->fills;
+		sum->coalesced += stats->coalesced;
+		sum->rejected += stats->rejected;
+		sum->uncached_seq_reads += stats->uncached_seq_reads;
+		sum->uncached_seq_writes += stats->uncached_seq_writes;
+		sum->dirty_blocks += stats->dirty_blocks;
+	}
+}
+
+/* Sum the per-CPU stats of a block size class */
+static void cache_stats_sum(struct cache_c *dmc, struct cache_stats *sum)
 {
-	struct cacheblock *cache = dmc->cache;
-	sector_t i = 0;
-	unsigned int j;
+	memset(sum, 0, sizeof(*sum));
+	cache_stats_fold(dmc, sum);
+}
+
+/* Sum the stats of all block size classes of a cache */
+static void cache_stats_total(struct cache_c *dmc, struct cache_stats *sum)
+{
+	unsigned int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i=0; i<dmc->nr_classes; i++)
+		cache_stats_fold(dmc->classes[i], sum);
+}
+
+/*
+ * Write back all dirty blocks, in the order of their source blocks so that
+ * the source device sees as few seeks as possible. The dirty frames are
+ * gathered and sorted in batches as large as memory allows, the whole cache
+ * in one batch if possible.
+ */
+static void cache_flush(struct cache_c *dmc, struct cache_stats *stats)
+{
+	u8 *states = dmc->states;
+	struct wb_frame one, *frames;
+	sector_t i = 0, n, cap, nr = 0;
+
+	DMINFO("Flush dirty blocks (%ld) ...", stats->dirty_blocks);
+	cap = min((sector_t)max(stats->dirty_blocks, 1L), dmc->size);
+	while (!(frames = vmalloc(cap * sizeof(*frames))) && cap > 1)
+		cap /= 2;
+	if (!frames) {
+		frames = &one;
+		cap = 1;
+	}
 
-	DMINFO("Flush dirty blocks (%llu) ...", (unsigned long long) dmc->dirty_blocks);
-	while (i< dmc->size) {
-		j = 1;
-		if (is_state(cache[i].state, DIRTY)) {
-			while ((i+j) < dmc->size && is_state(cache[i+j].state, DIRTY)
-			       && (cache[i+j].block == cache[i].block + j *
-			       dmc->block_size)) {
-				j++;
+	while (i < dmc->size) {
+		for (n=0; i<dmc->size && n<cap; i++) {
+			if (is_state(states[i], DIRTY) &&
+			    !is_state(states[i], WRITEBACK)) {
+				frames[n].block = dmc->tags[i];
+				frames[n].index = i;
+				n++;
 			}
-			dmc->dirty += j;
-			write_back(dmc, i, j);
 		}
-		i += j;
+		sort(frames, n, sizeof(*frames), wb_frame_cmp, NULL);
+		nr += wb_frames(dmc, frames, n);
 	}
+	cache_stat_add(dmc, dirty, nr);
+
+	/*
+	 * The last wb_done() still touches dmc after the count drops to zero;
+	 * it runs on the kcached workqueue, so wait for that as well. Frames
+	 * copied by kcopyd are counted too; see wb_copy_done().
+	 */
+	wait_event(dmc->flushq, !atomic_read(&dmc->nr_flushing));
+	flush_workqueue(_kcached_wq);
+	if (frames != &one)
+		vfree(frames);
 }
 
 /*
@@ -1693,23 +5530,38 @@ static void cache_flush(struct cache_c *dmc)
 static void cache_dtr(struct dm_target *ti)
 {
 	struct cache_c *dmc = (struct cache_c *) ti->private;
+	struct cache_stats stats;
+	unsigned int i;
 
-	if (dmc->dirty_blocks > 0) cache_flush(dmc);
+	for (i=0; i<dmc->nr_classes; i++) {
+		cache_stats_sum(dmc->classes[i], &stats);
+		if (stats.dirty_blocks > 0) cache_flush(dmc->classes[i], &stats);
+	}
 
-	kcached_client_destroy(dmc);
+	for (i=0; i<dmc->nr_classes; i++)
+		kcached_client_destroy(dmc->classes[i]);
 
 	dm_kcopyd_client_destroy(dmc->kcp_client);
 
-	if (dmc->reads + dmc->writes > 0)
+	cache_stats_total(dmc, &stats);
+	if (stats.reads + stats.writes > 0)
 		DMINFO("stats: reads(%lu), writes(%lu), cache hits(%lu, 0.%lu)," \
 		       "replacement(%lu), replaced dirty blocks(%lu), " \
 	           "flushed dirty blocks(%lu)",
-		       dmc->reads, dmc->writes, dmc->cache_hits,
-		       dmc->cache_hits * 100 / (dmc->reads + dmc->writes),
-		       dmc->replace, dmc->writeback, dmc->dirty);
+		       stats.reads, stats.writes, stats.cache_hits,
+		       stats.cache_hits * 100 / (stats.reads + stats.writes),
+		       stats.replace, stats.writeback, stats.dirty);
 
 	//dump_metadata(dmc); /* Always dump metadata to disk before exit */
-	vfree((void *)dmc->cache);
+	while (dmc->nr_classes > 1)
+		class_free(dmc->classes[--dmc->nr_classes]);
+	free_percpu(dmc->stats);
+	admit_exit(dmc);
+	corr_exit(dmc);
+	pf_partition_exit(dmc);
+	seq_exit(dmc);
+	dmc->policy->exit(dmc);
+	free_cache_frames(dmc);
 	dm_io_client_destroy(dmc->io_client);
 
 	dm_put_device(ti, dmc->src_dev);
@@ -1717,6 +5569,24 @@ static void cache_dtr(struct dm_target *ti)
 	kfree(dmc);
 }
 
+/* Count the frames holding a block, and those of them that are dirty */
+static void cache_occupancy(struct cache_c *dmc, sector_t *valid,
+	                        sector_t *dirty)
+{
+	sector_t i;
+	u8 state;
+
+	*valid = *dirty = 0;
+	for (i=0; i<dmc->size; i++) {
+		state = ACCESS_ONCE(dmc->states[i]);
+		if (is_state(state, VALID)) {
+			(*valid)++;
+			if (is_state(state, DIRTY))
+				(*dirty)++;
+		}
+	}
+}
+
 /*
  * Report cache status:
  *  Output cache stats upon request of device status;
@@ -1725,28 +5595,151 @@ static void cache_dtr(struct dm_target *ti)
 static int cache_status(struct dm_target *ti, status_type_t type,
 			 char *result, unsigned int maxlen)
 {
-	struct cache_c *dmc = (struct cache_c *) ti->private;
+	struct cache_c *dmc = (struct cache_c *) ti->private, *c;
+	struct cache_stats stats;
+	unsigned int nr_pages = 0, nr_free = 0, i;
+	int pf_frames = 0, pf_target = 0;
+	sector_t valid, dirty, capacity = 0;
 	int sz = 0;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
+		cache_stats_total(dmc, &stats);
 		DMEMIT("stats: reads(%lu), writes(%lu), cache hits(%lu, 0.%lu)," \
-	           "replacement(%lu), replaced dirty blocks(%lu)",
-	           dmc->reads, dmc->writes, dmc->cache_hits,
-	           (dmc->reads + dmc->writes) > 0 ? \
-	           dmc->cache_hits * 100 / (dmc->reads + dmc->writes) : 0,
-	           dmc->replace, dmc->writeback);
+	           "replacement(%lu), replaced dirty blocks(%lu), " \
+	           "prefetched blocks(%lu, used %lu, unused %lu), " \
+	           "rejected misses(%lu), " \
+	           "uncached sequential reads(%lu), writes(%lu)",
+	           stats.reads, stats.writes, stats.cache_hits,
+	           (stats.reads + stats.writes) > 0 ? \
+	           stats.cache_hits * 100 / (stats.reads + stats.writes) : 0,
+	           stats.replace, stats.writeback, stats.prefetch,
+	           stats.prefetch_hits, stats.prefetch_unused, stats.rejected,
+	           stats.uncached_seq_reads, stats.uncached_seq_writes);
+		for (i=0; i<dmc->nr_classes; i++) {
+			c = dmc->classes[i];
+			pf_frames += atomic_read(&c->pf_frames);
+			pf_target += atomic_read(&c->pf_target);
+			nr_pages += atomic_read(&c->nr_pages);
+			nr_free += min(kcached_free_pages(c),
+			               (unsigned int)atomic_read(&c->nr_pages));
+		}
+		DMEMIT(", prefetch partition(%d/%d)", pf_frames, pf_target);
+		DMEMIT(", strided prefetch hits(%lu, 0.%lu)", stats.stride_hits,
+		       stats.reads > 0 ? stats.stride_hits * 100 / stats.reads : 0);
+		DMEMIT(", correlated prefetch hits(%lu, 0.%lu)", stats.corr_hits,
+		       stats.reads > 0 ? stats.corr_hits * 100 / stats.reads : 0);
+		DMEMIT(", pages(%u in use, %u free), page stalls(%lu)",
+		       nr_pages - nr_free, nr_free, stats.page_stalls);
+		DMEMIT(", partial writes(%lu), sub-block fills(%lu)",
+		       stats.partial_writes, stats.fills);
+		DMEMIT(", coalesced read misses(%lu)", stats.coalesced);
+		for (i=0; i<dmc->nr_classes; i++) { /* Occupancy of each class */
+			c = dmc->classes[i];
+			cache_occupancy(c, &valid, &dirty);
+			DMEMIT(", %uK blocks(%llu/%llu used, %llu dirty)",
+			       c->block_size >> (10-SECTOR_SHIFT),
+			       (unsigned long long) valid, (unsigned long long) c->size,
+			       (unsigned long long) dirty);
+		}
 		break;
 	case STATUSTYPE_TABLE:
-		DMEMIT("conf: capacity(%lluM), associativity(%u), block size(%uK), %s",
-	           (unsigned long long) dmc->size * dmc->block_size >> 11,
-	           dmc->assoc, dmc->block_size>>(10-SECTOR_SHIFT),
-	           dmc->write_policy ? "write-back":"write-through");
+		for (i=0; i<dmc->nr_classes; i++)
+			capacity += dmc->classes[i]->size * dmc->classes[i]->block_size;
+		DMEMIT("conf: capacity(%lluM), associativity(%u), block size(",
+	           (unsigned long long) capacity >> 11, dmc->assoc);
+		for (i=0; i<dmc->nr_classes; i++)
+			DMEMIT("%s%uK", i ? "," : "",
+			       dmc->classes[i]->block_size>>(10-SECTOR_SHIFT));
+		DMEMIT("), %s, %s, %s",
+	           dmc->write_policy ? "write-back":"write-through",
+	           dmc->policy->name, dmc->admit ? "tinylfu" : "none");
+		DMEMIT(", sequential streams(%u), skip sequential threshold(%uKB)" \
+		       ", readahead(%uKB), successor table(%uKB)",
+		       dmc->nr_seq_streams, dmc->skip_seq_thresh_kb,
+		       dmc->readahead_kb, dmc->corr_kb);
+		DMEMIT(", early read completion(%s), max pages(%u)",
+		       dmc->early_read ? "on" : "off", dmc->max_pages);
 		break;
 	}
 	return 0;
 }
 
+/*
+ * Change a tunable at runtime:
+ *  message seq_streams <n>: number of sequential streams tracked
+ *  message skip_seq_thresh_kb <kb>: misses of streams longer than this go to
+ *    the source device without being cached; 0 caches every stream
+ *  message readahead_kb <kb>: largest readahead window of a sequential
+ *    stream; 0 turns readahead off unless the policy prefetches
+ *  message corr_kb <kb>: memory for the successor table of the correlation
+ *    prefetcher; 0 turns it off
+ *  message early_read_completion <0|1>: complete read misses as soon as the
+ *    source read finishes, storing a private copy in the cache afterwards
+ *  message max_pages <n>: most pages the I/O page pool may grow to
+ * Every block size class of the cache takes the value.
+ */
+static int cache_tune(struct cache_c *dmc, const char *name,
+	                  unsigned int value)
+{
+	if (!strcmp(name, "seq_streams"))
+		return seq_resize(dmc, value);
+
+	if (!strcmp(name, "skip_seq_thresh_kb")) {
+		spin_lock(&dmc->seq_lock);
+		dmc->skip_seq_thresh_kb = value;
+		spin_unlock(&dmc->seq_lock);
+		return 0;
+	}
+
+	if (!strcmp(name, "readahead_kb")) {
+		spin_lock(&dmc->seq_lock);
+		dmc->readahead_kb = value;
+		spin_unlock(&dmc->seq_lock);
+		return 0;
+	}
+
+	if (!strcmp(name, "corr_kb"))
+		return corr_resize(dmc, value);
+
+	if (!strcmp(name, "max_pages")) {
+		if (value < DMCACHE_MIN_PAGES)
+			return -EINVAL;
+		dmc->max_pages = value;
+		return 0;
+	}
+
+	if (!strcmp(name, "early_read_completion")) {
+		if (value > 1)
+			return -EINVAL;
+		dmc->early_read = value;
+		return 0;
+	}
+
+	DMWARN("Unrecognised message: %s", name);
+	return -EINVAL;
+}
+
+static int cache_message(struct dm_target *ti, unsigned int argc, char **argv)
+{
+	struct cache_c *dmc = (struct cache_c *) ti->private;
+	unsigned int value, i;
+	int r;
+
+	if (argc != 2 || sscanf(argv[1], "%u", &value) != 1) {
+		DMWARN("Invalid message: need a tunable and a value");
+		return -EINVAL;
+	}
+
+	for (i=0; i<dmc->nr_classes; i++) {
+		r = cache_tune(dmc->classes[i], argv[0], value);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
 
 /****************************************************************************
  *  Functions for manipulating a cache target.
@@ -1754,12 +5747,13 @@ static int cache_status(struct dm_target *ti, status_type_t type,
 
 static struct target_type cache_target = {
 	.name   = "cache",
-	.version= {1, 0, 1},
+	.version= {1, 1, 0},
 	.module = THIS_MODULE,
 	.ctr    = cache_ctr,
 	.dtr    = cache_dtr,
 	.map    = cache_map,
 	.status = cache_status,
+	.message = cache_message,
 };
 
 /*
@@ -1773,17 +5767,27 @@ int __init dm_cache_init(void)
 	if (r)
 		return r;
 
-	_kcached_wq = create_singlethread_workqueue("kcached");
+	/* One worker per CPU; the rescuer keeps I/O going under memory pressure */
+	_kcached_wq = alloc_workqueue("kcached", WQ_MEM_RECLAIM, 0);
 	if (!_kcached_wq) {
 		DMERR("failed to start kcached");
+		jobs_exit();
 		return -ENOMEM;
 	}
-	INIT_WORK(&_kcached_work, do_work);
+
+	r = split_init();
+	if (r) {
+		destroy_workqueue(_kcached_wq);
+		jobs_exit();
+		return r;
+	}
 
 	r = dm_register_target(&cache_target);
 	if (r < 0) {
 		DMERR("cache: register failed %d", r);
+		split_exit();
 		destroy_workqueue(_kcached_wq);
+		jobs_exit();
 	}
 
 	return r;
@@ -1796,8 +5800,9 @@ static void __exit dm_cache_exit(void)
 {
 	dm_unregister_target(&cache_target);
 
-	jobs_exit();
+	split_exit();
 	destroy_workqueue(_kcached_wq);
+	jobs_exit();
 }
 
 module_init(dm_cache_init);
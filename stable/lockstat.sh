@@ -0,0 +1,13 @@
+#!/usr/bin/env bash
+
+# Lock hold time and contention under a 32-thread random-read miss storm.
+# Needs a kernel with CONFIG_LOCK_STAT; run after start.sh on a fresh cache,
+# once on the tree before the lock-free job lists and once after.
+echo 0 > /proc/lock_stat
+echo 1 > /proc/sys/kernel/lock_stat
+fio -filename=/mnt/dmcache/2G.file -direct=1 -iodepth 1 -thread -rw=randread -ioengine=psync -bs=4k -size=2G -numjobs=32 -runtime=60 -time_based -group_reporting -name=missstorm
+echo 0 > /proc/sys/kernel/lock_stat
+dmsetup status
+# Most contended locks first; the job lists and the set locks of dm-cache
+head -n 40 /proc/lock_stat
+grep -A 4 -E 'job|kcached|set_spin_lock|requeue' /proc/lock_stat
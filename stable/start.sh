@@ -2,7 +2,9 @@
 
 modprobe dm-mod
 insmod dm-cache.ko
-echo 0 62914560 cache /dev/vdc /dev/vdb| dmsetup create pcache
+# Source, cache, persistence, block size in sectors (32 = 16KB); block sizes
+# and cache sizes may be comma lists for several classes, e.g. 8,256 65536,4096
+echo 0 62914560 cache /dev/vdc /dev/vdb 0 32 | dmsetup create pcache
 dmsetup status
 mkfs.ext4 /dev/mapper/pcache
 mount /dev/mapper/pcache /mnt/dmcache/
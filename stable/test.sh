@@ -1 +1,3 @@
+# Sequential reads of 512K; let streams ramp their readahead up to a full request
+dmsetup message pcache 0 readahead_kb 512
 fio -filename=/mnt/dmcache/2G.file -direct=1 -iodepth 1 -thread -rw=read -ioengine=psync -bs=512k -size=300M -numjobs=10 -runtime=1000 -group_reporting -name=mytest